@@ -0,0 +1,32 @@
+// throughput of the framebuffer encoders on a given image (e.g. a rendered framebuffer.tga)
+#include <chrono>
+#include <iostream>
+#include "../encoder.h"
+
+template<typename F> void run(const char *name, const TGAImage &img, F f) {
+    constexpr int repeat = 20;
+    std::size_t size = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r=0; r<repeat; r++)
+        size = f();
+    const double s  = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()/repeat;
+    const double mb = double(img.width())*img.height()*img.bytespp()/(1<<20);
+    std::cout << name << " " << s*1e3 << " ms/frame " << mb/s << " MB/s " << size << " bytes" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (2>argc) {
+        std::cerr << "Usage: " << argv[0] << " image.tga" << std::endl;
+        return 1;
+    }
+    TGAImage img;
+    if (!img.read_tga_file(argv[1])) return 1;
+    run("encode_tga_raw",     img, [&]() { return encode_tga(img, true, false).size(); });
+    run("encode_tga_rle",     img, [&]() { return encode_tga(img).size(); });
+    run("encode_png_stored",  img, [&]() { return encode_png(img, true, false).size(); });
+    run("encode_png_deflate", img, [&]() { return encode_png(img).size(); });
+    run("write_tga_file",     img, [&]() { img.write_tga_file("bench_encoder.tga"); return std::size_t(0); });
+    run("save_png",           img, [&]() { save_image(img, "bench_encoder.png"); return std::size_t(0); });
+    return 0;
+}
+
@@ -0,0 +1,56 @@
+// micro-benchmark of the geometry kernels: the generic cofactor expansion in double precision (the former
+// implementation of det() and invert()) against the closed-form single precision specializations
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../geometry.h"
+
+template<int n, typename T> mat<n,n,T> generic_invert(const mat<n,n,T> &m) {
+    mat<n,n,T> adj;
+    for (int i=n; i--; )
+        for (int j=n; j--; adj[i][j] = dt<n-1,T>::det(m.get_minor(i,j))*((i+j)%2 ? -1 : 1));
+    return (adj/(adj[0]*m[0])).transpose();
+}
+
+template<typename T> std::vector<mat<4,4,T>> random_matrices(const int count) {
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    std::vector<mat<4,4,T>> ret(count);
+    for (mat<4,4,T> &m : ret)
+        for (int i=4; i--; )
+            for (int j=4; j--; m[i][j] = dist(gen));
+    return ret;
+}
+
+template<typename F> void run(const char *name, const int count, F f) {
+    constexpr int repeat = 200;
+    double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r=0; r<repeat; r++)
+        for (int i=0; i<count; i++)
+            sink += f(i);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-start).count()/(repeat*count);
+    std::cout << name << " " << ns << " ns/op" << (sink==42 ? " " : "") << std::endl; // the sink keeps the loop alive
+}
+
+int main() {
+    constexpr int count = 4096;
+    const std::vector<mat<4,4,double>> md = random_matrices<double>(count);
+    const std::vector<mat<4,4,float>>  mf = random_matrices<float> (count);
+    const vec<4,double> vd = {1,2,3,4};
+    const vec<4,float>  vf = {1,2,3,4};
+
+    run("det4x4_generic_double", count, [&](int i) { return dt<4,double>::det(md[i]); });
+    run("det4x4_closed_double",  count, [&](int i) { return md[i].det(); });
+    run("det4x4_closed_float",   count, [&](int i) { return mf[i].det(); });
+    run("det3x3_generic_double", count, [&](int i) { return dt<3,double>::det(md[i].get_minor(0,0)); });
+    run("det3x3_closed_float",   count, [&](int i) { return mf[i].get_minor(0,0).det(); });
+    run("invert4x4_generic_double", count, [&](int i) { return generic_invert(md[i])[1][2]; });
+    run("invert4x4_closed_double",  count, [&](int i) { return md[i].invert()[1][2]; });
+    run("invert4x4_closed_float",   count, [&](int i) { return mf[i].invert()[1][2]; });
+    run("invert3x3_generic_double", count, [&](int i) { return generic_invert(md[i].get_minor(0,0))[1][2]; });
+    run("invert3x3_closed_float",   count, [&](int i) { return mf[i].get_minor(0,0).invert()[1][2]; });
+    run("matvec4_double", count, [&](int i) { return (md[i]*vd)[3]; });
+    run("matvec4_float",  count, [&](int i) { return (mf[i]*vf)[3]; });
+    return 0;
+}
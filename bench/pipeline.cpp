@@ -0,0 +1,375 @@
+// benchmark suite of the rendering pipeline: the bundled scenes at several resolutions and thread counts, the hot kernels,
+// and a check of the 800x800 renders against the golden images of bench/golden/ (--update-golden rewrites them).
+// One JSON object per line on stdout, the exit code is non-zero if a render differs from its golden image or a check fails.
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../encoder.h"
+#include "../shader.h"
+
+namespace {
+    const std::string root = SOURCE_DIR;
+    const vec3 light_dir{1,1,1}, eye{1,1,3}, center{0,0,0}, up{0,1,0}; // the camera of the demo
+
+    struct Scene { const char *name; std::vector<std::string> objs; };
+    const std::vector<Scene> scenes = {
+        {"african_head", {"obj/african_head/african_head.obj", "obj/african_head/african_head_eye_inner.obj"}},
+        {"boggie",       {"obj/boggie/body.obj", "obj/boggie/head.obj", "obj/boggie/eyes.obj"}},
+        {"diablo3_pose", {"obj/diablo3_pose/diablo3_pose.obj", "obj/floor.obj"}},
+        {"floor",        {"obj/floor.obj"}},
+    };
+
+    struct Json { // a flat JSON object, printed as a single line
+        std::ostringstream out;
+        Json(const std::string &bench) { out << "{\"bench\":\"" << bench << "\""; }
+        Json& operator()(const char *key, const std::string &value) { out << ",\"" << key << "\":\"" << value << "\""; return *this; }
+        Json& operator()(const char *key, const double value) { out << ",\"" << key << "\":" << value; return *this; }
+        ~Json() { std::cout << out.str() << "}" << std::endl; }
+    };
+
+    // runs f until at least min_time seconds and 3 runs have passed, returns the mean time of a run in seconds
+    template<typename F> double measure(F f, const double min_time=.3) {
+        f(); // warm-up
+        int runs = 0;
+        const auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        for (; runs<3 || elapsed<min_time; runs++, elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count())
+            f();
+        return elapsed/runs;
+    }
+
+    // a wavy n x n grid of quads with tex coords and normals, all the vertices first and then the faces, as the exporters write them
+    void write_grid_obj(const std::string &filename, const int n) {
+        FILE *out = std::fopen(filename.c_str(), "w");
+        if (!out) return;
+        auto height = [n](const int i, const int j) { return .05f*std::sin(i*.2f)*std::cos(j*.2f); };
+        for (int j=0; j<=n; j++)
+            for (int i=0; i<=n; i++) std::fprintf(out, "v %f %f %f\n", 2.f*i/n-1, 2.f*j/n-1, height(i, j));
+        for (int j=0; j<=n; j++)
+            for (int i=0; i<=n; i++) std::fprintf(out, "vt %f %f\n", float(i)/n, float(j)/n);
+        for (int j=0; j<=n; j++)
+            for (int i=0; i<=n; i++) {
+                const vec3 nrm = vec3{height(i-1, j)-height(i+1, j), height(i, j-1)-height(i, j+1), 4.f/n}.normalize();
+                std::fprintf(out, "vn %f %f %f\n", nrm.x, nrm.y, nrm.z);
+            }
+        for (int j=0; j<n; j++)
+            for (int i=0; i<n; i++) {
+                const int a = j*(n+1)+i+1, b = a+1, c = b+n+1, d = a+n+1;
+                std::fprintf(out, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a,a,a, b,b,b, c,c,c, d,d,d);
+            }
+        std::fclose(out);
+    }
+
+    void set_threads(const int n) {
+#ifdef _OPENMP
+        omp_set_num_threads(n);
+#endif
+    }
+
+    int max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // the cheapest possible fragment shader, measures the cost of the packet loop around the shader
+    struct FlatShader final : IShader {
+        static constexpr bool discards = false;
+        const Model &model;
+        const TGAColor flat;
+        FlatShader(const Model &m, const Uniforms &u, const TGAColor c = {255, 255, 255, 255}) : IShader(u), model(m), flat(c) {}
+        virtual void vertex(const int ivert, vec4 &gl_Position) { gl_Position = uniforms.MVP*embed<4>(model.vert(ivert)); }
+        virtual bool fragment(const int, const vec3, TGAColor &color) const { color = flat; return false; }
+        virtual unsigned fragment_packet(const int, const FragmentPacket &packet, TGAColor colors[packet_size]) const {
+            for (int k=0; k<packet_size; k++) colors[k] = flat;
+            return packet.mask;
+        }
+    };
+
+    // fraction of the pixels with a channel differing by more than tolerance
+    double image_difference(const TGAImage &a, const TGAImage &b, const int tolerance=8) {
+        if (a.width()!=b.width() || a.height()!=b.height() || a.bytespp()!=b.bytespp()) return 1;
+        std::size_t differ = 0, npixels = std::size_t(a.width())*a.height();
+        for (std::size_t i=0; i<npixels; i++) {
+            bool same = true;
+            for (int c=0; c<a.bytespp(); c++)
+                same &= std::abs(a.buffer()[i*a.bytespp()+c] - b.buffer()[i*a.bytespp()+c]) <= tolerance;
+            differ += !same;
+        }
+        return differ/double(npixels);
+    }
+}
+
+int main(int argc, char **argv) {
+    const bool update_golden = argc>1 && std::string(argv[1])=="--update-golden";
+    const double max_golden_diff = .001; // a render may differ from its golden image on 0.1% of the pixels
+    bool golden_ok = true;
+    const int nthreads = max_threads();
+    std::vector<int> thread_counts = {1};
+    if (nthreads>1) thread_counts.push_back(nthreads);
+
+    for (const Scene &scene : scenes) {
+        std::vector<Model> models;
+        for (const std::string &obj : scene.objs) models.emplace_back(root + "/" + obj);
+        for (int res : {400, 800, 1600})
+            for (int threads : thread_counts)
+                for (bool deferred : {false, true}) {
+                    set_threads(threads);
+                    RenderTarget framebuffer(res, res);
+                    RasterStats stats;
+                    const double s = measure([&]() { stats = render(models, eye, center, up, light_dir, framebuffer, {.lod_error = 0, .deferred = deferred}); }); // the full meshes
+                    Json("render")("scene", scene.name)("shading", deferred ? "deferred" : "forward")("width", res)("height", res)("threads", threads)
+                        ("ms_per_frame", s*1e3)("mtri_per_s", stats.primitives/s*1e-6)("mpix_per_s", double(res)*res/s*1e-6)("mfrag_per_s", stats.fragments_shaded/s*1e-6);
+                    if (res!=800 || threads!=1) continue;
+                    const std::string golden = root + "/bench/golden/" + scene.name + ".tga";
+                    if (update_golden) {
+                        if (!deferred) framebuffer.image().write_tga_file(golden);
+                        continue;
+                    }
+                    TGAImage expected;
+                    const bool found = expected.read_tga_file(golden);
+                    if (found) expected.flip_vertically(); // the framebuffer rows go from the bottom to the top, as in the written file
+                    const double diff = found ? image_difference(framebuffer.image(), expected) : 1;
+                    golden_ok &= diff<=max_golden_diff;
+                    Json("golden")("scene", scene.name)("shading", deferred ? "deferred" : "forward")("differing_pixels", diff)("status", diff<=max_golden_diff ? "ok" : "FAIL");
+                }
+    }
+    set_threads(nthreads);
+
+    // kernels, single-threaded, on the diablo scene
+    std::vector<Model> models;
+    models.emplace_back(root + "/obj/diablo3_pose/diablo3_pose.obj");
+    const Model &model = models[0];
+    { // the tangent frames of the model: unit, orthogonal to the vertex normal, w = +-1, and close to the frames of the faces around
+      // the vertex, derived from the uv gradients of the face as the shader used to do per pixel; a broken frame fails the suite
+        int malformed = 0, corners = 0, aligned = 0, handed = 0;
+        for (int i=0; i<model.nverts(); i++) {
+            const vec4 t = model.tangent(i);
+            const vec3 d = proj<3>(t);
+            malformed += std::abs(d.norm()-1)>1e-3 || std::abs(d*model.normal(i))>1e-3 || std::abs(t[3])!=1;
+        }
+        for (int f=0; f<model.nfaces(); f++) {
+            const vec3 e1 = model.vert(f,1)-model.vert(f,0), e2 = model.vert(f,2)-model.vert(f,0);
+            const vec2 d1 = model.uv(f,1)-model.uv(f,0), d2 = model.uv(f,2)-model.uv(f,0);
+            const float det = d1.x*d2.y - d2.x*d1.y;
+            if (det==0 || !std::isfinite(1/det)) continue; // no frame for degenerate tex coords
+            const vec3 face_t = (e1*d2.y - e2*d1.y)/det, face_b = (e2*d1.x - e1*d2.x)/det;
+            for (int k : {0,1,2}) {
+                const vec3 n = model.normal(f,k), t = proj<3>(model.tangent(f,k));
+                vec3 tk = face_t - n*(n*face_t);
+                if (tk.norm()==0) continue;
+                corners++;
+                aligned += t*tk.normalize() > std::cos(M_PI/6);
+                handed  += (cross(n, t)*face_b<0 ? -1.f : 1.f)==model.tangent(f,k)[3];
+            }
+        }
+        const bool ok = !malformed && aligned>=.9*corners && handed>=.98*corners; // the faces around a vertex mostly agree, diablo: 95% and 99%
+        golden_ok &= ok;
+        Json("check")("name", "tangent_frames")("vertices", model.nverts())("malformed", malformed)("corners_within_30deg", aligned/double(std::max(corners, 1)))
+            ("corners_same_handedness", handed/double(std::max(corners, 1)))("status", ok ? "ok" : "FAIL");
+    }
+    const Uniforms uniforms(lookat(eye, center, up), projection((eye-center).norm()), viewport(100, 100, 600, 600));
+    Shader shader(model, uniforms, light_dir);
+    std::vector<vec4> clip(model.nverts());
+    for (int i=0; i<model.nverts(); i++) shader.vertex(i, clip[i]);
+
+    RenderTarget framebuffer(800, 800);
+    { // the model, then a quad facing the camera, drawn again over themselves in a second flush: the depths are equal, the later
+      // triangles must win everywhere, the hierarchical depth buffer must not reject any of them for the rounding of the interpolated depth
+        const FlatShader first(model, uniforms, {0, 0, 255, 255}), second(model, uniforms);
+        std::size_t pixels = 0, lost = 0;
+        for (const bool quad : {false, true}) {
+            framebuffer.clear();
+            for (const FlatShader *sh : {&first, &second}) {
+                Rasterizer rasterizer(framebuffer);
+                if (quad)
+                    for (const float z : {.1f, .3f, .7f}) { // a strip of the screen per depth, w<0 is in front of this camera
+                        const vec4 a = {1, 1.2f-2*z, -z, -1}, b = {-1, 1.2f-2*z, -z, -1}, c = {-1, .8f-2*z, -z, -1}, d = {1, .8f-2*z, -z, -1};
+                        const vec4 tri[4][3] = {{a, b, c}, {a, c, d}, {a, c, b}, {a, d, c}}; // both windings, either may be culled
+                        for (const auto &t : tri) rasterizer.triangle(t, *sh, 0);
+                    }
+                else
+                    for (int i=0; i<model.nfaces(); i++) {
+                        const vec4 tri[3] = {clip[model.index(i,0)], clip[model.index(i,1)], clip[model.index(i,2)]};
+                        rasterizer.triangle(tri, *sh, i);
+                    }
+                rasterizer.flush();
+            }
+            pixels += framebuffer.covered();
+            for (int y=0; y<framebuffer.height(); y++)
+                for (int x=0; x<framebuffer.width(); x++)
+                    lost += framebuffer.depth_row(y)[x]!=RenderTarget::far && framebuffer.color_row(y)[x]!=RenderTarget::pack({255, 255, 255, 255});
+        }
+        golden_ok &= !lost;
+        Json("check")("name", "coplanar_redraw")("pixels", pixels)("not_redrawn", lost)("status", lost ? "FAIL" : "ok");
+    }
+    {
+        double s = measure([&]() {
+            Rasterizer rasterizer(framebuffer);
+            for (int i=0; i<model.nfaces(); i++) {
+                const vec4 tri[3] = {clip[model.index(i,0)], clip[model.index(i,1)], clip[model.index(i,2)]};
+                rasterizer.triangle(tri, shader, i);
+            }
+        });
+        Json("kernel")("name", "triangle_setup")("ms", s*1e3)("mtri_per_s", model.nfaces()/s*1e-6);
+        s = measure([&]() {
+            Rasterizer rasterizer(framebuffer);
+            rasterizer.draw(shader, model.nverts(), model.indices());
+        });
+        Json("kernel")("name", "draw")("ms", s*1e3)("mtri_per_s", model.nfaces()/s*1e-6);
+        RasterStats stats;
+        s = measure([&]() {
+            framebuffer.clear();
+            Rasterizer rasterizer(framebuffer);
+            rasterizer.draw(shader, model.nverts(), model.indices());
+            rasterizer.flush();
+            stats = rasterizer.stats;
+        });
+        Json("kernel")("name", "draw_and_flush")("ms", s*1e3)("mtri_per_s", model.nfaces()/s*1e-6)("mfrag_per_s", stats.fragments_shaded/s*1e-6);
+        const double full = s;
+        const FlatShader flat(model, uniforms);
+        for (const bool erased : {false, true}) // the packet loop compiled for the shader type vs the virtual calls of a plugin
+            for (const IShader *sh : {static_cast<const IShader *>(&shader), static_cast<const IShader *>(&flat)}) {
+                s = measure([&]() {
+                    framebuffer.clear();
+                    Rasterizer rasterizer(framebuffer);
+                    for (int i=0; i<model.nfaces(); i++) {
+                        const vec4 tri[3] = {clip[model.index(i,0)], clip[model.index(i,1)], clip[model.index(i,2)]};
+                        if (erased)            rasterizer.triangle(tri, *sh, i);
+                        else if (sh==&shader)  rasterizer.triangle(tri, shader, i);
+                        else                   rasterizer.triangle(tri, flat, i);
+                    }
+                    rasterizer.flush();
+                });
+                Json("kernel")("name", "shader_dispatch")("shader", sh==&shader ? "phong" : "flat")("dispatch", erased ? "virtual" : "static")("ms", s*1e3);
+            }
+        s = measure([&]() { shadow_map(models, light_dir, 800); }); // the same triangles, depth-only, no fragment shading
+        Json("kernel")("name", "shadow_map")("ms", s*1e3)("mtri_per_s", model.nfaces()/s*1e-6)("fraction_of_draw", s/full);
+        const ShadowMap shadow = shadow_map(models, light_dir, 1024);
+        const double plain = measure([&]() { render(models, eye, center, up, light_dir, framebuffer); });
+        s = measure([&]() { render(models, eye, center, up, light_dir, framebuffer, {.shadow = &shadow}); });
+        Json("kernel")("name", "shadow_lookup_pcf")("ms", s*1e3)("overhead_ms", (s-plain)*1e3);
+        for (int n : {2, 4, 8}) {
+            s = measure([&]() { render(models, eye, center, up, light_dir, framebuffer, {.samples = n}); });
+            Json("kernel")("name", "msaa")("samples", n)("ms", s*1e3)("overhead_ms", (s-plain)*1e3);
+        }
+        const vec3 close_eye = {.3f, -.1f, .6f}, close_center = {.3f, -.1f, 0}; // a close-up, part of the model is out of view
+        RasterStats culled, unculled;
+        s = measure([&]() { culled = render(models, close_eye, close_center, up, light_dir, framebuffer); });
+        const double all = measure([&]() { unculled = render(models, close_eye, close_center, up, light_dir, framebuffer, {.frustum_culling = false}); });
+        Json("kernel")("name", "frustum_culling")("ms", s*1e3)("ms_without", all*1e3)("faces_skipped", culled.culled_frustum)
+            ("vertices_shaded", culled.vertices)("vertices_shaded_without", unculled.vertices);
+        const vec3 far_eye = eye*10, far_center = eye*9; // the same direction, the model 10x smaller on the screen
+        RasterStats coarse, full_mesh;
+        s = measure([&]() { coarse = render(models, far_eye, far_center, up, light_dir, framebuffer); });
+        const double detailed = measure([&]() { full_mesh = render(models, far_eye, far_center, up, light_dir, framebuffer, {.lod_error = 0}); });
+        Json("kernel")("name", "lod")("ms", s*1e3)("ms_without", detailed*1e3)("faces_skipped", coarse.culled_lod)
+            ("triangles", coarse.primitives)("triangles_without", full_mesh.primitives);
+        RenderTarget supersampled(1600, 1600); // the alternative to 4x MSAA: 4x the pixels, all of them shaded
+        s = measure([&]() { render(models, eye, center, up, light_dir, supersampled); });
+        Json("kernel")("name", "ssaa")("samples", 4)("ms", s*1e3)("overhead_ms", (s-plain)*1e3);
+    }
+    {
+        constexpr int count = 1<<16;
+        std::mt19937 gen(0);
+        std::uniform_real_distribution<float> dist(0, 1);
+        std::vector<vec3> bars(count);
+        std::vector<int> faces(count);
+        std::vector<vec2> uvs(count);
+        for (int i=0; i<count; i++) {
+            float a = dist(gen), b = dist(gen);
+            if (a+b>1) { a = 1-a; b = 1-b; }
+            bars[i]  = {a, b, 1-a-b};
+            faces[i] = std::uniform_int_distribution<int>(0, model.nfaces()-1)(gen);
+            uvs[i]   = {dist(gen), dist(gen)};
+        }
+        TGAColor color;
+        double s = measure([&]() { for (int i=0; i<count; i++) shader.fragment(faces[i], bars[i], color); });
+        Json("kernel")("name", "fragment")("ns_per_fragment", s/count*1e9)("mfrag_per_s", count/s*1e-6);
+        s = measure([&]() {
+            TGAColor colors[packet_size];
+            for (int i=0; i+packet_size<=count; i+=packet_size) {
+                FragmentPacket packet;
+                for (int k=0; k<packet_size; k++) // the quad of a face around a random point
+                    for (int j : {0,1,2}) packet.bar[j][k] = bars[i][j] + (k%packet_w)*.001f*(j==0) + (k/packet_w)*.001f*(j==1) - ((k%packet_w)+(k/packet_w))*.001f*(j==2);
+                packet.x = packet.y = 0;
+                packet.mask = (1u<<packet_size)-1;
+                shader.fragment_packet(faces[i], packet, colors);
+            }
+        });
+        Json("kernel")("name", "fragment_packet")("ns_per_fragment", s/count*1e9)("mfrag_per_s", count/s*1e-6);
+        vec4 sink;
+        s = measure([&]() { for (int i=0; i<count; i++) sink = sink + model.diffuse().sample(uvs[i]); });
+        Json("kernel")("name", "texture_bilinear")("ns_per_sample", s/count*1e9);
+        const vec2 d = {.002f, 0};
+        s = measure([&]() { for (int i=0; i<count; i++) sink = sink + model.diffuse().sample(uvs[i], d, d); });
+        Json("kernel")("name", "texture_trilinear")("ns_per_sample", s/count*1e9);
+        volatile float keep = sink[0]; // the samples must not be optimized away
+        (void)keep;
+    }
+    {
+        const std::filesystem::path tmp = std::filesystem::temp_directory_path() / "tinyrenderer_bench.obj";
+        std::filesystem::copy_file(root + "/obj/diablo3_pose/diablo3_pose.obj", tmp, std::filesystem::copy_options::overwrite_existing);
+        const double mb = std::filesystem::file_size(tmp)/double(1<<20);
+        double s = measure([&]() {
+            std::filesystem::remove(tmp.string() + ".cache");
+            Model m(tmp.string(), false); // parses the obj file, then writes the cache
+        });
+        Json("kernel")("name", "obj_parse")("ms", s*1e3)("mb_per_s", mb/s);
+        const double lods = measure([&]() {
+            std::filesystem::remove(tmp.string() + ".cache");
+            Model m(tmp.string()); // the same, and the levels of detail
+        });
+        Json("kernel")("name", "lod_build")("faces", Model(tmp.string()).nfaces())("ms", (lods-s)*1e3);
+        s = measure([&]() { Model m(tmp.string()); });
+        Json("kernel")("name", "obj_cached")("ms", s*1e3);
+        std::filesystem::remove(tmp);
+        std::filesystem::remove(tmp.string() + ".cache");
+
+        // time to the first image of a large mesh: the whole model is loaded (cache miss) then drawn, vs drawn while it is parsed
+        const std::string grid = (std::filesystem::temp_directory_path() / "tinyrenderer_bench_grid.obj").string();
+        write_grid_obj(grid, 300);
+        auto once = [](auto f) {
+            const auto start = std::chrono::steady_clock::now();
+            f();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        };
+        RenderTarget target(800, 800);
+        RasterStats streamed;
+        std::size_t batches = 0;
+        const double parse = once([&]() { ModelStream stream(grid); while (stream.next()) batches++; });
+        s = once([&]() { streamed = render_stream({grid}, eye, center, up, light_dir, target); });
+        std::vector<Model> whole;
+        const double load = once([&]() { whole.emplace_back(grid, false); }); // the batches have no levels of detail
+        const double draw = once([&]() { render(whole, eye, center, up, light_dir, target, {.lod_error = 0}); });
+        std::filesystem::remove(grid + ".cache");
+        const double load_lods = once([&]() { Model m(grid); });
+        Json("kernel")("name", "obj_stream")("faces", streamed.primitives)("batches", batches)("ms_to_image", s*1e3)("parse_ms", parse*1e3)
+            ("whole_load_ms", load*1e3)("whole_render_ms", draw*1e3)("whole_ms_to_image", (load+draw)*1e3)("whole_load_with_lods_ms", load_lods*1e3);
+        std::filesystem::remove(grid);
+        std::filesystem::remove(grid + ".cache");
+
+        TGAImage img;
+        const std::string texture = root + "/obj/diablo3_pose/diablo3_pose_diffuse.tga";
+        s = measure([&]() { img.read_tga_file(texture); });
+        const double tex_mb = double(img.width())*img.height()*img.bytespp()/(1<<20);
+        Json("kernel")("name", "tga_read")("ms", s*1e3)("mb_per_s", tex_mb/s);
+        const std::string out = (std::filesystem::temp_directory_path() / "tinyrenderer_bench.tga").string();
+        s = measure([&]() { img.write_tga_file(out); });
+        Json("kernel")("name", "tga_write")("ms", s*1e3)("mb_per_s", tex_mb/s);
+        std::filesystem::remove(out);
+    }
+    return golden_ok ? 0 : 1;
+}
+
@@ -0,0 +1,27 @@
+// decoding speed of the tga reader, e.g. bench_tga ../obj/*/*.tga
+#include <chrono>
+#include <iostream>
+#include "../tgaimage.h"
+
+int main(int argc, char **argv) {
+    if (2>argc) {
+        std::cerr << "Usage: " << argv[0] << " image.tga..." << std::endl;
+        return 1;
+    }
+    constexpr int repeat = 5;
+    double total_s = 0, total_mb = 0;
+    for (int i=1; i<argc; i++) {
+        TGAImage img;
+        auto start = std::chrono::steady_clock::now();
+        for (int r=0; r<repeat; r++)
+            if (!img.read_tga_file(argv[i])) return 1;
+        const double s  = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()/repeat;
+        const double mb = double(img.width())*img.height()*img.bytespp()/(1<<20);
+        std::cout << "read_tga " << argv[i] << " " << s*1e3 << " ms " << mb/s << " MB/s" << std::endl;
+        total_s  += s;
+        total_mb += mb;
+    }
+    std::cout << "read_tga_total " << total_s*1e3 << " ms " << total_mb/total_s << " MB/s" << std::endl;
+    return 0;
+}
+
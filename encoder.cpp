@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include "encoder.h"
+#include "profiler.h"
+
+namespace {
+    constexpr int band_height = 16; // rows per independently encoded band
+
+    int nbands(const TGAImage &img) {
+        return (img.height()+band_height-1)/band_height;
+    }
+
+    // TGA run-length packets of a single row, a packet never crosses a scanline
+    void rle_row(const std::uint8_t *row, const int w, const int bpp, std::vector<std::uint8_t> &out) {
+        auto same = [row, bpp](const int a, const int b) { return !std::memcmp(row+a*bpp, row+b*bpp, bpp); };
+        for (int x=0; x<w; ) {
+            int run = 1;
+            while (x+run<w && run<128 && same(x, x+run)) run++;
+            if (run>1) { // run-length packet
+                out.push_back(127+run);
+                out.insert(out.end(), row+x*bpp, row+(x+1)*bpp);
+                x += run;
+                continue;
+            }
+            int raw = 1; // raw packet up to the next pair of equal pixels
+            while (x+raw<w && raw<128 && !(x+raw+1<w && same(x+raw, x+raw+1))) raw++;
+            out.push_back(raw-1);
+            out.insert(out.end(), row+x*bpp, row+(x+raw)*bpp);
+            x += raw;
+        }
+    }
+
+    std::uint32_t crc32(const std::uint8_t *data, const std::size_t size, std::uint32_t crc=0) { // slicing-by-8
+        static const std::array<std::array<std::uint32_t, 256>, 8> table = [] {
+            std::array<std::array<std::uint32_t, 256>, 8> t;
+            for (std::uint32_t n=0; n<256; n++) {
+                std::uint32_t c = n;
+                for (int k=0; k<8; k++) c = c&1 ? 0xedb88320u^(c>>1) : c>>1;
+                t[0][n] = c;
+            }
+            for (int s=1; s<8; s++)
+                for (int n=0; n<256; n++)
+                    t[s][n] = (t[s-1][n]>>8) ^ t[0][t[s-1][n] & 0xff];
+            return t;
+        }();
+        crc = ~crc;
+        std::size_t i = 0;
+        for (; i+8<=size; i+=8) {
+            std::uint32_t lo, hi;
+            std::memcpy(&lo, data+i, 4);
+            std::memcpy(&hi, data+i+4, 4);
+            lo ^= crc; // little endian
+            crc = table[7][lo & 0xff] ^ table[6][lo>>8 & 0xff] ^ table[5][lo>>16 & 0xff] ^ table[4][lo>>24] ^
+                  table[3][hi & 0xff] ^ table[2][hi>>8 & 0xff] ^ table[1][hi>>16 & 0xff] ^ table[0][hi>>24];
+        }
+        for (; i<size; i++) crc = table[0][(crc^data[i]) & 0xff] ^ (crc>>8);
+        return ~crc;
+    }
+
+    constexpr std::uint32_t adler_base = 65521;
+
+    std::uint32_t adler32(const std::uint8_t *data, const std::size_t size) {
+        std::uint32_t a = 1, b = 0;
+        for (std::size_t i=0; i<size; ) {
+            const std::size_t end = std::min(size, i+5552); // no overflow before the modulo
+            for (; i<end; i++) { a += data[i]; b += a; }
+            a %= adler_base;
+            b %= adler_base;
+        }
+        return b<<16 | a;
+    }
+
+    // checksum of the concatenation of two buffers from their checksums, len2 is the length of the second one
+    std::uint32_t adler32_combine(const std::uint32_t adler1, const std::uint32_t adler2, const std::size_t len2) {
+        const std::uint32_t rem = len2 % adler_base;
+        std::uint32_t sum1 = adler1 & 0xffff;
+        std::uint32_t sum2 = (std::uint64_t(rem)*sum1) % adler_base;
+        sum1 += (adler2 & 0xffff) + adler_base - 1;
+        sum2 += (adler1>>16) + (adler2>>16) + adler_base - rem;
+        if (sum1>=adler_base) sum1 -= adler_base;
+        if (sum1>=adler_base) sum1 -= adler_base;
+        if (sum2>=2*adler_base) sum2 -= 2*adler_base;
+        if (sum2>=adler_base) sum2 -= adler_base;
+        return sum2<<16 | sum1;
+    }
+
+    struct BitWriter { // deflate bit order: least significant bit first
+        std::vector<std::uint8_t> &out;
+        std::uint64_t bits = 0;
+        int nbits = 0;
+        void put(const std::uint32_t value, const int n) {
+            bits |= std::uint64_t(value)<<nbits;
+            nbits += n;
+            while (nbits>=8) {
+                out.push_back(bits & 0xff);
+                bits >>= 8;
+                nbits -= 8;
+            }
+        }
+        void put_code(const std::uint32_t code, const int n) { // Huffman codes are stored most significant bit first
+            std::uint32_t rev = 0;
+            for (int i=0; i<n; i++) rev |= (code>>i & 1) << (n-1-i);
+            put(rev, n);
+        }
+        void align() { if (nbits) put(0, 8-nbits); }
+    };
+
+    void fixed_literal(BitWriter &bw, const int sym) { // fixed Huffman code of a literal/length symbol
+        if (sym<144)      bw.put_code(0x30+sym, 8);
+        else if (sym<256) bw.put_code(0x190+sym-144, 9);
+        else if (sym<280) bw.put_code(sym-256, 7);
+        else              bw.put_code(0xc0+sym-280, 8);
+    }
+
+    // one fixed-Huffman block whose only matches are byte runs (distance 1), followed by an empty stored block
+    // that brings the stream to a byte boundary, so that the independently compressed bands can be concatenated
+    void deflate_band(const std::uint8_t *data, const std::size_t size, std::vector<std::uint8_t> &out) {
+        static constexpr int len_base[29]  = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static constexpr int len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        BitWriter bw{out};
+        bw.put(0, 1); // not the final block
+        bw.put(1, 2); // fixed Huffman codes
+        for (std::size_t i=0; i<size; ) {
+            std::size_t run = 0;
+            if (i>0)
+                while (i+run<size && run<258 && data[i+run]==data[i-1]) run++;
+            if (run<3) {
+                fixed_literal(bw, data[i++]);
+                continue;
+            }
+            const int code = std::upper_bound(len_base, len_base+29, int(run)) - len_base - 1;
+            fixed_literal(bw, 257+code);
+            bw.put(run-len_base[code], len_extra[code]);
+            bw.put_code(0, 5); // distance code 0: distance 1
+            i += run;
+        }
+        fixed_literal(bw, 256); // end of block
+        bw.put(0, 3);           // empty stored block
+        bw.align();
+        out.insert(out.end(), {0x00, 0x00, 0xff, 0xff});
+    }
+
+    void stored_band(const std::uint8_t *data, const std::size_t size, std::vector<std::uint8_t> &out) {
+        for (std::size_t i=0; i<size; i+=65535) {
+            const std::uint16_t len = std::min<std::size_t>(65535, size-i);
+            out.insert(out.end(), {0x00, std::uint8_t(len & 0xff), std::uint8_t(len>>8), std::uint8_t(~len & 0xff), std::uint8_t(~len>>8 & 0xff)});
+            out.insert(out.end(), data+i, data+i+len);
+        }
+    }
+
+    void put_be32(std::vector<std::uint8_t> &out, const std::uint32_t v) {
+        for (int shift : {24, 16, 8, 0}) out.push_back(v>>shift & 0xff);
+    }
+
+    void png_chunk(std::vector<std::uint8_t> &out, const char type[4], const std::uint8_t *data, const std::size_t size) {
+        put_be32(out, size);
+        const std::size_t start = out.size();
+        out.insert(out.end(), type, type+4);
+        if (size) out.insert(out.end(), data, data+size);
+        put_be32(out, crc32(out.data()+start, size+4));
+    }
+}
+
+std::vector<std::uint8_t> encode_tga(const TGAImage &img, const bool vflip, const bool rle) {
+    PROFILE_SCOPE("encode tga");
+    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    const int w = img.width(), h = img.height(), bpp = img.bytespp();
+    TGAHeader header;
+    header.bitsperpixel = bpp<<3;
+    header.width  = w;
+    header.height = h;
+    header.datatypecode = (bpp==TGAImage::GRAYSCALE?(rle?11:3):(rle?10:2));
+    header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
+    std::vector<std::uint8_t> out(reinterpret_cast<const std::uint8_t *>(&header), reinterpret_cast<const std::uint8_t *>(&header)+sizeof(header));
+    if (!rle) {
+        out.insert(out.end(), img.buffer(), img.buffer()+std::size_t(w)*h*bpp);
+    } else {
+        std::vector<std::vector<std::uint8_t>> bands(nbands(img));
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int b=0; b<(int)bands.size(); b++) {
+            bands[b].reserve(std::size_t(w)*band_height*bpp/4);
+            for (int y=b*band_height; y<std::min(h, (b+1)*band_height); y++)
+                rle_row(img.buffer()+std::size_t(y)*w*bpp, w, bpp, bands[b]);
+        }
+        std::size_t size = out.size();
+        for (const auto &band : bands) size += band.size();
+        out.reserve(size + sizeof(developer_area_ref) + sizeof(extension_area_ref) + sizeof(footer));
+        for (const auto &band : bands) out.insert(out.end(), band.begin(), band.end());
+    }
+    out.insert(out.end(), developer_area_ref, developer_area_ref+sizeof(developer_area_ref));
+    out.insert(out.end(), extension_area_ref, extension_area_ref+sizeof(extension_area_ref));
+    out.insert(out.end(), footer, footer+sizeof(footer));
+    return out;
+}
+
+std::vector<std::uint8_t> encode_png(const TGAImage &img, const bool vflip, const bool deflate) {
+    PROFILE_SCOPE("encode png");
+    const int w = img.width(), h = img.height(), bpp = img.bytespp();
+    const std::size_t stride = std::size_t(w)*bpp + 1; // filter type byte + pixels
+    std::vector<std::uint8_t> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    const std::uint8_t color_type = bpp==TGAImage::GRAYSCALE ? 0 : (bpp==TGAImage::RGB ? 2 : 6);
+    const std::uint8_t ihdr[13] = {std::uint8_t(w>>24), std::uint8_t(w>>16), std::uint8_t(w>>8), std::uint8_t(w),
+                                   std::uint8_t(h>>24), std::uint8_t(h>>16), std::uint8_t(h>>8), std::uint8_t(h),
+                                   8, color_type, 0, 0, 0}; // 8 bits per channel, deflate, adaptive filtering, no interlace
+    png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+    std::vector<std::vector<std::uint8_t>> bands(nbands(img));
+    std::vector<std::uint32_t> adler(bands.size());
+    std::vector<std::size_t> raw_size(bands.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int b=0; b<(int)bands.size(); b++) {
+        const int y0 = b*band_height, y1 = std::min(h, (b+1)*band_height);
+        std::vector<std::uint8_t> raw(stride*(y1-y0)); // filtered scanlines, PNG rows go from the top to the bottom
+        for (int y=y0; y<y1; y++) {
+            const std::uint8_t *src = img.buffer() + std::size_t(vflip ? h-1-y : y)*w*bpp;
+            std::uint8_t *dst = raw.data() + (y-y0)*stride;
+            dst[0] = deflate ? 1 : 0; // the Sub filter turns the flat areas into zero runs
+            std::memcpy(dst+1, src, std::size_t(w)*bpp);
+            if (bpp>1)
+                for (int x=0; x<w; x++) std::swap(dst[1+x*bpp], dst[3+x*bpp]); // BGR(A) to RGB(A)
+            if (deflate) // right to left, so that the left neighbours are not filtered yet
+                for (std::size_t i=stride-1; i>std::size_t(bpp); i--)
+                    dst[i] -= dst[i-bpp];
+        }
+        adler[b] = adler32(raw.data(), raw.size());
+        raw_size[b] = raw.size();
+        if (deflate) deflate_band(raw.data(), raw.size(), bands[b]);
+        else         stored_band (raw.data(), raw.size(), bands[b]);
+    }
+    std::vector<std::uint8_t> idat = {0x78, 0x01}; // zlib header: deflate, 32K window, no dictionary
+    std::uint32_t checksum = 1;
+    for (int b=0; b<(int)bands.size(); b++) {
+        idat.insert(idat.end(), bands[b].begin(), bands[b].end());
+        checksum = adler32_combine(checksum, adler[b], raw_size[b]);
+    }
+    idat.insert(idat.end(), {0x01, 0x00, 0x00, 0xff, 0xff}); // final empty stored block
+    put_be32(idat, checksum);
+    png_chunk(out, "IDAT", idat.data(), idat.size());
+    png_chunk(out, "IEND", nullptr, 0);
+    return out;
+}
+
+bool write_file(const std::string &filename, const std::vector<std::uint8_t> &bytes) {
+    PROFILE_SCOPE("write file");
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    if (!out.good()) {
+        std::cerr << "can't dump the file " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool save_image(const TGAImage &img, const std::string &filename) {
+    const bool png = filename.size()>=4 && filename.compare(filename.size()-4, 4, ".png")==0;
+    return write_file(filename, png ? encode_png(img) : encode_tga(img));
+}
+
+void ImageWriter::save(TGAImage img, const std::string &filename) {
+    wait();
+    pending = std::async(std::launch::async, [img = std::move(img), filename]() { return save_image(img, filename); });
+}
+
+bool ImageWriter::wait() {
+    if (pending.valid()) ok &= pending.get();
+    return ok;
+}
+
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+// in-memory image encoders: the image is split into bands of rows compressed in parallel,
+// the encoded bands are concatenated and the file is written with a single write
+std::vector<std::uint8_t> encode_tga(const TGAImage &img, const bool vflip=true, const bool rle=true);
+std::vector<std::uint8_t> encode_png(const TGAImage &img, const bool vflip=true, const bool deflate=true); // stored (uncompressed) deflate blocks if !deflate
+bool write_file(const std::string &filename, const std::vector<std::uint8_t> &bytes);
+bool save_image(const TGAImage &img, const std::string &filename); // the format is chosen by the extension, .png or .tga
+
+// saves the images on a background thread, at most one image is being encoded at a time
+class ImageWriter {
+    std::future<bool> pending{};
+    bool ok = true; // no save has failed so far
+public:
+    void save(TGAImage img, const std::string &filename); // the image is copied, the caller may reuse it right away
+    bool wait(); // false if any save so far has failed
+    ~ImageWriter() { wait(); }
+};
+
@@ -2,86 +2,90 @@
 #include <cmath>
 #include <cassert>
 #include <iostream>
+#include <type_traits>
 
-template<int n> struct vec {
-    double & operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
-    double   operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
-    double data[n] = {0};
+// the scalar type defaults to float for the rendering pipeline; scalar arguments of the operators
+// are not deduced (std::type_identity_t), so that e.g. a vec<3,float> can be scaled by a double literal
+
+template<int n, typename T=float> struct vec {
+    constexpr T & operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
+    constexpr T   operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
+    constexpr T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
+    alignas(n==4 ? 4*sizeof(T) : alignof(T)) T data[n] = {0}; // vec4 is 16-byte aligned (for floats) to map onto a SIMD register
 };
 
-template<int n> double operator*(const vec<n>& lhs, const vec<n>& rhs) {
-    double ret = 0;
+template<int n, typename T> constexpr T operator*(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    T ret = 0;
     for (int i=n; i--; ret+=lhs[i]*rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> constexpr vec<n,T> operator+(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]+=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> constexpr vec<n,T> operator-(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]-=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator*(const double& rhs, const vec<n> &lhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> constexpr vec<n,T> operator*(const std::type_identity_t<T>& rhs, const vec<n,T> &lhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator*(const vec<n>& lhs, const double& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> constexpr vec<n,T> operator*(const vec<n,T>& lhs, const std::type_identity_t<T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator/(const vec<n>& lhs, const double& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> constexpr vec<n,T> operator/(const vec<n,T>& lhs, const std::type_identity_t<T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]/=rhs);
     return ret;
 }
 
-template<int n1,int n2> vec<n1> embed(const vec<n2> &v, double fill=1) {
-    vec<n1> ret;
+template<int n1,int n2,typename T> constexpr vec<n1,T> embed(const vec<n2,T> &v, std::type_identity_t<T> fill=1) {
+    vec<n1,T> ret;
     for (int i=n1; i--; ret[i]=(i<n2?v[i]:fill));
     return ret;
 }
 
-template<int n1,int n2> vec<n1> proj(const vec<n2> &v) {
-    vec<n1> ret;
+template<int n1,int n2,typename T> constexpr vec<n1,T> proj(const vec<n2,T> &v) {
+    vec<n1,T> ret;
     for (int i=n1; i--; ret[i]=v[i]);
     return ret;
 }
 
-template<int n> std::ostream& operator<<(std::ostream& out, const vec<n>& v) {
+template<int n, typename T> std::ostream& operator<<(std::ostream& out, const vec<n,T>& v) {
     for (int i=0; i<n; i++) out << v[i] << " ";
     return out;
 }
 
-template<> struct vec<2> {
-    double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
+template<typename T> struct vec<2,T> {
+    constexpr T& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr T  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
     vec & normalize() { *this = (*this)/norm(); return *this; }
 
-    double x{}, y{};
+    T x{}, y{};
 };
 
-template<> struct vec<3> {
-    double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
+template<typename T> struct vec<3,T> {
+    constexpr T& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr T  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr T norm2() const { return *this * *this; }
+    T norm() const { return std::sqrt(norm2()); }
     vec & normalize() { *this = (*this)/norm(); return *this; }
 
-    double x{}, y{}, z{};
+    T x{}, y{}, z{};
 };
 
 typedef vec<2> vec2;
@@ -89,125 +93,157 @@ typedef vec<3> vec3;
 typedef vec<4> vec4;
 vec3 cross(const vec3 &v1, const vec3 &v2);
 
-template<int n> struct dt;
+template<int n, typename T> struct dt;
 
-template<int nrows,int ncols> struct mat {
-    vec<ncols> rows[nrows] = {{}};
+template<int nrows,int ncols,typename T=float> struct mat {
+    vec<ncols,T> rows[nrows] = {{}};
 
-          vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
-    const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr       vec<ncols,T>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr const vec<ncols,T>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
 
-    vec<nrows> col(const int idx) const {
+    constexpr vec<nrows,T> col(const int idx) const {
         assert(idx>=0 && idx<ncols);
-        vec<nrows> ret;
+        vec<nrows,T> ret;
         for (int i=nrows; i--; ret[i]=rows[i][idx]);
         return ret;
     }
 
-    void set_col(const int idx, const vec<nrows> &v) {
+    constexpr void set_col(const int idx, const vec<nrows,T> &v) {
         assert(idx>=0 && idx<ncols);
         for (int i=nrows; i--; rows[i][idx]=v[i]);
     }
 
-    static mat<nrows,ncols> identity() {
-        mat<nrows,ncols> ret;
+    static constexpr mat<nrows,ncols,T> identity() {
+        mat<nrows,ncols,T> ret;
         for (int i=nrows; i--; )
             for (int j=ncols;j--; ret[i][j]=(i==j));
         return ret;
     }
 
-    double det() const {
-        return dt<ncols>::det(*this);
+    constexpr T det() const {
+        static_assert(nrows==ncols);
+        if constexpr (3==nrows) {
+            const mat &m = *this;
+            return m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1]) - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0]) + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        } else if constexpr (4==nrows) {
+            const mat &m = *this;
+            const T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2], s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+            const T s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2], s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+            const T c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3], c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+            const T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2], c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+            return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+        } else
+            return dt<ncols,T>::det(*this);
     }
 
-    mat<nrows-1,ncols-1> get_minor(const int row, const int col) const {
-        mat<nrows-1,ncols-1> ret;
+    constexpr mat<nrows-1,ncols-1,T> get_minor(const int row, const int col) const {
+        mat<nrows-1,ncols-1,T> ret;
         for (int i=nrows-1; i--; )
             for (int j=ncols-1;j--; ret[i][j]=rows[i<row?i:i+1][j<col?j:j+1]);
         return ret;
     }
 
-    double cofactor(const int row, const int col) const {
+    constexpr T cofactor(const int row, const int col) const {
         return get_minor(row,col).det()*((row+col)%2 ? -1 : 1);
     }
 
-    mat<nrows,ncols> adjugate() const {
-        mat<nrows,ncols> ret;
-        for (int i=nrows; i--; )
-            for (int j=ncols; j--; ret[i][j]=cofactor(i,j));
+    // the matrix of the cofactors (the transposed adjugate), closed form for 3x3 and 4x4 matrices
+    constexpr mat<nrows,ncols,T> adjugate() const {
+        static_assert(nrows==ncols);
+        mat<nrows,ncols,T> ret;
+        const mat &m = *this;
+        if constexpr (3==nrows) {
+            for (int i=3; i--; ) { // the i-th row of the cofactors is the cross product of the two other rows
+                const vec<3,T> &a = m[(i+1)%3], &b = m[(i+2)%3];
+                ret[i] = {a[1]*b[2] - a[2]*b[1], a[2]*b[0] - a[0]*b[2], a[0]*b[1] - a[1]*b[0]};
+            }
+        } else if constexpr (4==nrows) { // Laplace expansion over the 2x2 minors of the two upper and the two lower rows
+            const T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2], s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+            const T s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2], s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+            const T c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3], c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+            const T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2], c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+            ret[0] = {  m[1][1]*c5 - m[1][2]*c4 + m[1][3]*c3,  -m[1][0]*c5 + m[1][2]*c2 - m[1][3]*c1,   m[1][0]*c4 - m[1][1]*c2 + m[1][3]*c0,  -m[1][0]*c3 + m[1][1]*c1 - m[1][2]*c0 };
+            ret[1] = { -m[0][1]*c5 + m[0][2]*c4 - m[0][3]*c3,   m[0][0]*c5 - m[0][2]*c2 + m[0][3]*c1,  -m[0][0]*c4 + m[0][1]*c2 - m[0][3]*c0,   m[0][0]*c3 - m[0][1]*c1 + m[0][2]*c0 };
+            ret[2] = {  m[3][1]*s5 - m[3][2]*s4 + m[3][3]*s3,  -m[3][0]*s5 + m[3][2]*s2 - m[3][3]*s1,   m[3][0]*s4 - m[3][1]*s2 + m[3][3]*s0,  -m[3][0]*s3 + m[3][1]*s1 - m[3][2]*s0 };
+            ret[3] = { -m[2][1]*s5 + m[2][2]*s4 - m[2][3]*s3,   m[2][0]*s5 - m[2][2]*s2 + m[2][3]*s1,  -m[2][0]*s4 + m[2][1]*s2 - m[2][3]*s0,   m[2][0]*s3 - m[2][1]*s1 + m[2][2]*s0 };
+        } else {
+            for (int i=nrows; i--; )
+                for (int j=ncols; j--; ret[i][j]=cofactor(i,j));
+        }
         return ret;
     }
 
-    mat<nrows,ncols> invert_transpose() const {
-        mat<nrows,ncols> ret = adjugate();
+    constexpr mat<nrows,ncols,T> invert_transpose() const {
+        mat<nrows,ncols,T> ret = adjugate();
         return ret/(ret[0]*rows[0]);
     }
 
-    mat<nrows,ncols> invert() const {
+    constexpr mat<nrows,ncols,T> invert() const {
         return invert_transpose().transpose();
     }
 
-    mat<ncols,nrows> transpose() const {
-        mat<ncols,nrows> ret;
+    constexpr mat<ncols,nrows,T> transpose() const {
+        mat<ncols,nrows,T> ret;
         for (int i=ncols; i--; ret[i]=this->col(i));
         return ret;
     }
 };
 
-template<int nrows,int ncols> vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
-    vec<nrows> ret;
+template<int nrows,int ncols,typename T> constexpr vec<nrows,T> operator*(const mat<nrows,ncols,T>& lhs, const vec<ncols,T>& rhs) {
+    vec<nrows,T> ret;
     for (int i=nrows; i--; ret[i]=lhs[i]*rhs);
     return ret;
 }
 
-template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
-    mat<R1,C2> result;
+template<int R1,int C1,int C2,typename T> constexpr mat<R1,C2,T> operator*(const mat<R1,C1,T>& lhs, const mat<C1,C2,T>& rhs) {
+    mat<R1,C2,T> result;
     for (int i=R1; i--; )
         for (int j=C2; j--; result[i][j]=lhs[i]*rhs.col(j));
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
-    mat<nrows,ncols> result;
+template<int nrows,int ncols,typename T> constexpr mat<nrows,ncols,T> operator*(const mat<nrows,ncols,T>& lhs, const std::type_identity_t<T>& val) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; result[i] = lhs[i]*val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
-    mat<nrows,ncols> result;
+template<int nrows,int ncols,typename T> constexpr mat<nrows,ncols,T> operator/(const mat<nrows,ncols,T>& lhs, const std::type_identity_t<T>& val) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; result[i] = lhs[i]/val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
-    mat<nrows,ncols> result;
+template<int nrows,int ncols,typename T> constexpr mat<nrows,ncols,T> operator+(const mat<nrows,ncols,T>& lhs, const mat<nrows,ncols,T>& rhs) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]+rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
-    mat<nrows,ncols> result;
+template<int nrows,int ncols,typename T> constexpr mat<nrows,ncols,T> operator-(const mat<nrows,ncols,T>& lhs, const mat<nrows,ncols,T>& rhs) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]-rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols> std::ostream& operator<<(std::ostream& out, const mat<nrows,ncols>& m) {
+template<int nrows,int ncols,typename T> std::ostream& operator<<(std::ostream& out, const mat<nrows,ncols,T>& m) {
     for (int i=0; i<nrows; i++) out << m[i] << std::endl;
     return out;
 }
 
-template<int n> struct dt {
-    static double det(const mat<n,n>& src) {
-        double ret = 0;
-        for (int i=n; i--; ret += src[0][i]*src.cofactor(0,i));
+// generic cofactor expansion along the first row, used for the sizes without a closed form
+template<int n, typename T> struct dt {
+    static constexpr T det(const mat<n,n,T>& src) {
+        T ret = 0;
+        for (int i=n; i--; ret += src[0][i]*dt<n-1,T>::det(src.get_minor(0,i))*(i%2 ? -1 : 1));
         return ret;
     }
 };
 
-template<> struct dt<1> {
-    static double det(const mat<1,1>& src) {
+template<typename T> struct dt<1,T> {
+    static constexpr T det(const mat<1,1,T>& src) {
         return src[0][0];
     }
 };
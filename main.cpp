@@ -1,6 +1,17 @@
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <limits>
-#include "model.h"
-#include "our_gl.h"
+#include <optional>
+#include <sstream>
+#include "encoder.h"
+#include "profiler.h"
+#include "shader.h"
 
 constexpr int width  = 800; // output image size
 constexpr int height = 800;
@@ -10,74 +21,176 @@ const vec3       eye{1,1,3}; // camera position
 const vec3    center{0,0,0}; // camera direction
 const vec3        up{0,1,0}; // camera up vector
 
-extern mat<4,4> ModelView; // "OpenGL" state matrices
-extern mat<4,4> Projection;
+struct Pose { vec3 eye, center, up; };
 
-struct Shader : IShader {
-    const Model &model;
-    vec3 uniform_l;       // light direction in view coordinates
-    mat<2,3> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
-    mat<3,3> varying_nrm; // normal per vertex to be interpolated by FS
-    mat<3,3> view_tri;    // triangle in view coordinates
+// the whole string is a number
+template<typename T> bool parse_number(const std::string &s, T &value) {
+    const auto [end, ec] = std::from_chars(s.data(), s.data()+s.size(), value);
+    return ec==std::errc() && end==s.data()+s.size();
+}
 
-    Shader(const Model &m) : model(m) {
-        uniform_l = proj<3>((ModelView*embed<4>(light_dir, 0.))).normalize(); // transform the light vector to view coordinates
+// one camera pose per line: eye, center and up, 9 numbers; empty lines and lines starting with # are skipped
+bool read_poses(const std::string &filename, std::vector<Pose> &poses) {
+    std::ifstream in(filename);
+    if (!in.is_open()) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t\r")==std::string::npos || line[line.find_first_not_of(" \t")]=='#') continue;
+        std::istringstream iss(line);
+        Pose p;
+        for (vec3 *v : {&p.eye, &p.center, &p.up})
+            iss >> v->x >> v->y >> v->z;
+        if (iss.fail()) return false;
+        poses.push_back(p);
     }
+    return !poses.empty();
+}
 
-    virtual void vertex(const int iface, const int nthvert, vec4& gl_Position) {
-        varying_uv.set_col(nthvert, model.uv(iface, nthvert));
-        varying_nrm.set_col(nthvert, proj<3>((ModelView).invert_transpose()*embed<4>(model.normal(iface, nthvert), 0.)));
-        gl_Position= ModelView*embed<4>(model.vert(iface, nthvert));
-        view_tri.set_col(nthvert, proj<3>(gl_Position));
-        gl_Position = Projection*gl_Position;
+// turntable: the default eye is rotated about the up axis passing through the center
+std::vector<Pose> orbit(const int nframes) {
+    std::vector<Pose> poses;
+    const vec3 axis = vec3(up).normalize(), r = eye - center;
+    const vec3 r_par = axis*(r*axis), r_perp = r - r_par;
+    for (int i=0; i<nframes; i++) {
+        const float a = 2*M_PI*i/nframes;
+        poses.push_back({center + r_par + r_perp*std::cos(a) + cross(axis, r_perp)*std::sin(a), center, up});
     }
+    return poses;
+}
 
-    virtual bool fragment(const vec3 bar, TGAColor &gl_FragColor) {
-        vec3 bn = (varying_nrm*bar).normalize(); // per-vertex normal interpolation
-        vec2 uv = varying_uv*bar; // tex coord interpolation
-
-        // for the math refer to the tangent space normal mapping lecture
-        // https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
-        mat<3,3> AI = mat<3,3>{ {view_tri.col(1) - view_tri.col(0), view_tri.col(2) - view_tri.col(0), bn} }.invert();
-        vec3 i = AI * vec3{varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0};
-        vec3 j = AI * vec3{varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0};
-        mat<3,3> B = mat<3,3>{ {i.normalize(), j.normalize(), bn} }.transpose();
+void print_stats(const RasterStats &st, const std::uint64_t pixels_covered) {
+    std::cerr << "# vertex shader invocations " << st.vertices << " for " << st.primitives << " triangles, ACMR " << st.vertices/(double)std::max<std::uint64_t>(st.primitives, 1) << std::endl;
+    std::cerr << "# culled frustum " << st.culled_frustum << " level of detail " << st.culled_lod << " offscreen " << st.culled_offscreen << " backface " << st.culled_backface << " degenerate " << st.culled_degenerate
+              << " clipped " << st.clipped << std::endl;
+    std::cerr << "# triangles " << st.triangles << " hi-z rejects " << st.hiz_rejects << " (" << st.pixels_skipped << " pixels skipped)"
+              << " fragments " << st.fragments << " depth culled " << st.fragments_culled << std::endl;
+    std::cerr << "# fragments shaded " << st.fragments_shaded << " for " << pixels_covered << " pixels covered, overdraw "
+              << st.fragments_shaded/(double)std::max<std::uint64_t>(pixels_covered, 1) << std::endl;
+    PROFILE_COUNTER("triangles skipped by the bvh", st.culled_frustum);
+    PROFILE_COUNTER("triangles skipped by the levels of detail", st.culled_lod);
+    PROFILE_COUNTER("triangles submitted", st.primitives);
+    PROFILE_COUNTER("triangles culled", st.culled_offscreen + st.culled_backface + st.culled_degenerate);
+    PROFILE_COUNTER("triangles binned", st.triangles);
+    PROFILE_COUNTER("fragments tested", st.fragments);
+    PROFILE_COUNTER("fragments passed", st.fragments - st.fragments_culled);
+    PROFILE_COUNTER("fragments shaded", st.fragments_shaded);
+    PROFILE_COUNTER("overdraw", st.fragments_shaded/(double)std::max<std::uint64_t>(pixels_covered, 1));
+}
 
-        vec3 n = (B * model.normal(uv)).normalize(); // transform the normal from the texture to the tangent space
-        double diff = std::max(0., n*uniform_l); // diffuse light intensity
-        vec3 r = (n*(n*uniform_l)*2 - uniform_l).normalize(); // reflected light direction, specular mapping is described here: https://github.com/ssloy/tinyrenderer/wiki/Lesson-6-Shaders-for-the-software-renderer
-        double spec = std::pow(std::max(-r.z, 0.), 5+sample2D(model.specular(), uv)[0]); // specular intensity, note that the camera lies on the z-axis (in view), therefore simple -r.z
+int main(int argc, char** argv) {
+    std::vector<Pose> poses;
+    std::string prefix = "frame", format = "tga", trace;
+    bool batch = false, stream = false;
+    RenderOptions options;
+    int shadow_size = 0, pcf = 1; // no shadows by default
+    auto usage = [&argv]() {
+        std::cerr << "Usage: " << argv[0] << " [--orbit nframes] [--poses file] [-o prefix] [--format tga|png] [--shading forward|deferred] [--msaa 1|2|4|8] [--shadows size] [--pcf radius] [--lod pixels] [--load whole|stream] [--trace trace.json] obj/model.obj..." << std::endl;
+        return 1;
+    };
+    int arg = 1;
+    for (; arg<argc && argv[arg][0]=='-'; arg+=2) {
+        if (arg+1>=argc) {
+            std::cerr << argv[arg] << ": missing value" << std::endl;
+            return usage();
+        }
+        const std::string opt = argv[arg], value = argv[arg+1];
+        int n = 0;
+        float x = 0;
+        if (opt=="--orbit" && parse_number(value, n) && n>0) {
+            const std::vector<Pose> o = orbit(n);
+            poses.insert(poses.end(), o.begin(), o.end());
+        } else if (opt=="--poses") {
+            if (!read_poses(value, poses)) {
+                std::cerr << "can't read the camera poses from " << value << std::endl;
+                return 1;
+            }
+        } else if (opt=="-o") {
+            prefix = value;
+        } else if (opt=="--format" && (value=="tga" || value=="png")) {
+            format = value;
+            continue; // a single frame may be saved as png
+        } else if (opt=="--shading" && (value=="forward" || value=="deferred")) {
+            options.deferred = value=="deferred";
+            continue;
+        } else if (opt=="--msaa" && parse_number(value, n) && n>0 && n<=max_samples && std::has_single_bit(unsigned(n))) {
+            options.samples = n;
+            continue;
+        } else if (opt=="--shadows" && parse_number(value, n) && n>0) {
+            shadow_size = n;
+            continue;
+        } else if (opt=="--lod" && parse_number(value, x) && x>=0) {
+            options.lod_error = x;
+            continue;
+        } else if (opt=="--load" && (value=="whole" || value=="stream")) {
+            stream = value=="stream";
+            continue;
+        } else if (opt=="--pcf" && parse_number(value, n) && n>=0) {
+            pcf = n;
+            continue;
+        } else if (opt=="--trace") {
+            trace = value;
+#ifndef PROFILER
+            std::cerr << "--trace: the profiler is not compiled in, configure with -DENABLE_PROFILER=ON" << std::endl;
+#endif
+            continue;
+        } else {
+            std::cerr << "unknown option or invalid value: " << opt << " " << value << std::endl;
+            return usage();
+        }
+        batch = true;
+    }
+    if (arg>=argc) return usage();
+    if (stream && (poses.size()>1 || shadow_size || options.samples>1)) {
+        std::cerr << "--load stream renders a single frame without shadows nor msaa, the models are never whole and every batch is resolved" << std::endl;
+        return 1;
+    }
+    if (poses.empty()) poses.push_back({eye, center, up});
 
-        TGAColor c = sample2D(model.diffuse(), uv);
-        for (int i : {0,1,2})
-            gl_FragColor[i] = std::min<int>(10 + c[i]*(diff + spec), 255); // (a bit of ambient light, diff + spec), clamp the result
+    const std::vector<std::string> files(argv+arg, argv+argc);
+    std::vector<Model> models; // loaded once for all the frames, or streamed by the single frame
+    if (!stream)
+        for (const std::string &file : files) models.emplace_back(file, options.lod_error>0); // --lod 0 never draws the levels, they are not built
 
-        return false; // the pixel is not discarded
+    std::optional<ShadowMap> shadow; // the light and the models do not move, the map is shared by all the frames
+    if (shadow_size) {
+        const auto start = std::chrono::steady_clock::now();
+        shadow = shadow_map(models, light_dir, shadow_size);
+        shadow->pcf = pcf;
+        options.shadow = &*shadow;
+        std::cerr << "shadow map rendered in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count() << " ms" << std::endl;
     }
-};
 
-int main(int argc, char** argv) {
-    if (2>argc) {
-        std::cerr << "Usage: " << argv[0] << " obj/model.obj" << std::endl;
-        return 1;
-    }
-    TGAImage framebuffer(width, height, TGAImage::RGB); // the output image
-    lookat(eye, center, up);                            // build the ModelView matrix
-    viewport(width/8, height/8, width*3/4, height*3/4); // build the Viewport matrix
-    projection((eye-center).norm());                    // build the Projection matrix
-    std::vector<double> zbuffer(width*height, std::numeric_limits<double>::max());
+    // frame i is encoded and written by a background thread while frame i+1 is rendered,
+    // the rasterization itself runs on the OpenMP thread team, which persists from one frame to another
+    RenderTarget framebuffer(width, height); // cleared by render(), converted to an image for the writer
+    ImageWriter writer;
+    RasterStats total{};
+    std::uint64_t pixels_covered = 0;
+    for (int f=0; f<(int)poses.size(); f++) {
+        PROFILE_SCOPE("frame");
+        const auto start = std::chrono::steady_clock::now();
+        const Pose &pose = poses[f];
+        const RasterStats stats = stream ? render_stream(files, pose.eye, pose.center, pose.up, light_dir, framebuffer, options)
+                                         : render(models, pose.eye, pose.center, pose.up, light_dir, framebuffer, options);
+        total += stats;
+        pixels_covered += framebuffer.covered();
 
-    for (int m=1; m<argc; m++) { // iterate through all input objects
-        Model model(argv[m]);
-        Shader shader(model);
-        for (int i=0; i<model.nfaces(); i++) { // for every triangle
-            vec4 clip_vert[3]; // triangle coordinates (clip coordinates), written by VS, read by FS
-            for (int j : {0,1,2})
-                shader.vertex(i, j, clip_vert[j]); // call the vertex shader for each triangle vertex
-            triangle(clip_vert, shader, framebuffer, zbuffer); // actual rasterization routine call
+        std::string filename = "framebuffer." + format;
+        if (batch) {
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d", f);
+            filename = prefix + number + "." + format;
         }
+        writer.save(framebuffer.image(), filename); // the vertical flip is done by the encoder
+        if (batch)
+            std::cerr << "frame " << f << " rendered in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count() << " ms" << std::endl;
     }
-    framebuffer.write_tga_file("framebuffer.tga"); // the vertical flip is moved inside the function
-    return 0;
+    const bool saved = writer.wait();
+    print_stats(total, pixels_covered);
+#ifdef PROFILER
+    profiler::summary(std::cerr);
+    if (!trace.empty() && profiler::write_trace(trace))
+        std::cerr << "trace written to " << trace << std::endl;
+#endif
+    return saved ? 0 : 1;
 }
-
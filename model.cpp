@@ -1,53 +1,644 @@
+#include <algorithm>
 #include <iostream>
-#include <sstream>
+#include <fstream>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <array>
+#include <mutex>
+#include <unordered_map>
 #include "model.h"
+#include "profiler.h"
+#include "simplify.h"
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-Model::Model(const std::string filename) {
-    std::ifstream in;
-    in.open(filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            vec3 v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
-            iss >> trash >> trash;
-            vec3 n;
-            for (int i=0;i<3;i++) iss >> n[i];
-            norms.push_back(n.normalize());
-        } else if (!line.compare(0, 3, "vt ")) {
-            iss >> trash >> trash;
-            vec2 uv;
-            for (int i=0;i<2;i++) iss >> uv[i];
-            tex_coord.push_back({uv.x, 1-uv.y});
-        }  else if (!line.compare(0, 2, "f ")) {
-            int f,t,n;
-            iss >> trash;
-            int cnt = 0;
-            while (iss >> f >> trash >> t >> trash >> n) {
-                facet_vrt.push_back(--f);
-                facet_tex.push_back(--t);
-                facet_nrm.push_back(--n);
-                cnt++;
+struct Model::Mesh { // deduplicated vertices owned by the model when it is not loaded from the cache
+    std::vector<vec3> verts{};
+    std::vector<vec2> tex_coord{};
+    std::vector<vec3> norms{};
+    std::vector<vec4> tangents{};
+    std::vector<int> facet{};
+    std::vector<Model::BVHNode> nodes{};
+    std::vector<int> node_faces{};
+    std::vector<int> lod_facet{};
+    int nlods = 0;
+    std::array<std::uint32_t, Model::max_lods+1> lod_offsets{};
+    std::array<float, Model::max_lods> lod_errors{};
+};
+
+namespace {
+    // read-only view of the whole file, memory-mapped where the platform allows it
+    class FileView {
+        const char *ptr = nullptr;
+        std::size_t len = 0;
+        std::string buffer; // fallback storage when mmap is not available
+        std::size_t released = 0; // length of the prefix already given back, see release()
+    public:
+        FileView(const std::string &filename) {
+#if __has_include(<sys/mman.h>)
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd<0) return;
+            struct stat st;
+            if (!fstat(fd, &st) && st.st_size>0) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p!=MAP_FAILED) {
+                    madvise(p, st.st_size, MADV_SEQUENTIAL);
+                    ptr = static_cast<const char *>(p);
+                    len = st.st_size;
+                }
             }
-            if (3!=cnt) {
-                std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
-                in.close();
-                return;
+            close(fd);
+#else
+            std::ifstream in(filename, std::ios::binary);
+            if (in.fail()) return;
+            buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            ptr = buffer.data();
+            len = buffer.size();
+#endif
+        }
+        ~FileView() {
+#if __has_include(<sys/mman.h>)
+            if (ptr) munmap(const_cast<char *>(ptr), len);
+#endif
+        }
+        FileView(const FileView&) = delete;
+        FileView& operator=(const FileView&) = delete;
+        const char *data() const { return ptr; }
+        std::size_t size() const { return len; }
+        void release(const char *until) { // the bytes before until are read for good, their pages leave the memory of the process
+#if __has_include(<sys/mman.h>)
+            const std::size_t page = sysconf(_SC_PAGESIZE), n = (until-ptr)/page*page;
+            if (n>released) madvise(const_cast<char *>(ptr)+released, n-released, MADV_DONTNEED);
+            released = std::max(released, n);
+#endif
+        }
+    };
+
+    constexpr int missing = INT_MIN;      // face corner without a tex coord or a normal index
+    constexpr std::size_t chunk_size = 1<<20; // the file is split into chunks of about 1 MiB parsed in parallel
+    constexpr std::size_t piece_size = 1<<16; // the streaming parser reads about 64 KiB at a time, a batch holds the faces they resolve
+    constexpr std::size_t frame_lookahead = 4; // a batch is handed out once that many more are parsed, their faces complete its tangent frames
+
+    // everything parsed from a chunk of lines; positive obj indices are already global,
+    // negative (relative) ones are only resolved against the chunk and are listed in the relative arrays
+    struct Chunk {
+        std::vector<vec3> verts{}, norms{};
+        std::vector<vec2> tex_coord{};
+        std::vector<int> facet_vrt{}, facet_tex{}, facet_nrm{};
+        std::vector<std::size_t> relative_vrt{}, relative_tex{}, relative_nrm{};
+        std::size_t bad_faces = 0;
+    };
+
+    using Mesh = Model::Mesh;
+
+    constexpr int bvh_leaf_size = 64;       // faces per leaf, a leaf is culled or drawn as a whole
+    constexpr int bvh_task_size = 1<<14;    // subtrees with fewer faces are built by a single thread
+
+    int bvh_subtree_nodes(const int nfaces) { // the tree shape only depends on the face count, median splits
+        return nfaces<=bvh_leaf_size ? 1 : 1 + bvh_subtree_nodes(nfaces/2) + bvh_subtree_nodes(nfaces-nfaces/2);
+    }
+
+    // builds the subtree rooted at nodes[node] over faces[begin,end); the node indices are known in advance,
+    // so the subtrees are built by independent tasks and the result does not depend on the scheduling
+    void build_bvh(const int node, const int begin, const int end, const std::vector<vec3> &box_min, const std::vector<vec3> &box_max,
+                   const std::vector<vec3> &centroid, std::vector<Model::BVHNode> &nodes, std::vector<int> &faces) {
+        Model::BVHNode &n = nodes[node];
+        vec3 cmin = centroid[faces[begin]], cmax = cmin;
+        n.bbox_min = box_min[faces[begin]];
+        n.bbox_max = box_max[faces[begin]];
+        for (int i=begin; i<end; i++)
+            for (int d : {0,1,2}) {
+                const int f = faces[i];
+                n.bbox_min[d] = std::min(n.bbox_min[d], box_min[f][d]);
+                n.bbox_max[d] = std::max(n.bbox_max[d], box_max[f][d]);
+                cmin[d] = std::min(cmin[d], centroid[f][d]);
+                cmax[d] = std::max(cmax[d], centroid[f][d]);
+            }
+        if (end-begin<=bvh_leaf_size) {
+            n.first = begin;
+            n.count = end-begin;
+            return;
+        }
+        const vec3 extent = cmax-cmin;
+        const int axis = extent.x>=extent.y && extent.x>=extent.z ? 0 : extent.y>=extent.z ? 1 : 2;
+        const int mid = begin + (end-begin)/2;
+        std::nth_element(faces.begin()+begin, faces.begin()+mid, faces.begin()+end, [&](const int a, const int b) {
+            return centroid[a][axis]<centroid[b][axis] || (centroid[a][axis]==centroid[b][axis] && a<b);
+        });
+        n.first = node + 1 + bvh_subtree_nodes(mid-begin);
+        n.count = 0;
+        const int right = n.first;
+#pragma omp task if(end-begin>bvh_task_size) default(shared)
+        build_bvh(node+1, begin, mid, box_min, box_max, centroid, nodes, faces);
+        build_bvh(right, mid, end, box_min, box_max, centroid, nodes, faces);
+#pragma omp taskwait
+    }
+
+    void build_bvh(Mesh &mesh) {
+        const int nfaces = mesh.facet.size()/3;
+        if (!nfaces) return;
+        std::vector<vec3> box_min(nfaces), box_max(nfaces), centroid(nfaces);
+#pragma omp parallel for
+        for (int f=0; f<nfaces; f++) {
+            const vec3 &a = mesh.verts[mesh.facet[f*3]], &b = mesh.verts[mesh.facet[f*3+1]], &c = mesh.verts[mesh.facet[f*3+2]];
+            for (int d : {0,1,2}) {
+                box_min[f][d] = std::min({a[d], b[d], c[d]});
+                box_max[f][d] = std::max({a[d], b[d], c[d]});
             }
+            centroid[f] = (a+b+c)/3;
+        }
+        mesh.node_faces.resize(nfaces);
+        for (int f=0; f<nfaces; f++) mesh.node_faces[f] = f;
+        mesh.nodes.resize(bvh_subtree_nodes(nfaces));
+#pragma omp parallel
+#pragma omp single
+        build_bvh(0, 0, nfaces, box_min, box_max, centroid, mesh.nodes, mesh.node_faces);
+    }
+
+    // the contribution of a face to the tangent frame sums of its corners: the tangent and bitangent of the face (the directions
+    // of increasing u and v) projected onto the tangent plane of every corner, weighted by the corner angle
+    void accumulate_frames(const vec3 (&p)[3], const vec2 (&uv)[3], const vec3 *(&n)[3], vec3 *(&tan)[3], vec3 *(&bitan)[3]) {
+        const vec3 e1 = p[1]-p[0], e2 = p[2]-p[0];
+        const vec2 d1 = uv[1]-uv[0], d2 = uv[2]-uv[0];
+        const float det = d1.x*d2.y - d2.x*d1.y;
+        if (det==0 || !std::isfinite(1/det)) return; // degenerate tex coords, no frame
+        const vec3 t = (e1*d2.y - e2*d1.y)/det, b = (e2*d1.x - e1*d2.x)/det;
+        for (int k : {0,1,2}) {
+            const vec3 a = p[(k+1)%3]-p[k], c = p[(k+2)%3]-p[k];
+            if (a.norm()==0 || c.norm()==0) continue;
+            const float angle = std::acos(std::clamp(a*c/(a.norm()*c.norm()), -1.f, 1.f));
+            const vec3 tk = t - *n[k]*(*n[k]*t), bk = b - *n[k]*(*n[k]*b);
+            if (tk.norm()>0) *tan[k]   = *tan[k]   + tk/tk.norm()*angle;
+            if (bk.norm()>0) *bitan[k] = *bitan[k] + bk/bk.norm()*angle;
         }
     }
-    in.close();
-    std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << tex_coord.size() << " vn# " << norms.size() << std::endl;
-    load_texture(filename, "_diffuse.tga",    diffusemap );
-    load_texture(filename, "_nm_tangent.tga", normalmap  );
-    load_texture(filename, "_spec.tga",       specularmap);
+
+    // the frame of a vertex from its sums: the tangent orthonormalized against the normal, the handedness on which side the bitangent lies
+    vec4 tangent_frame(const vec3 &n, const vec3 &tan, const vec3 &bitan) {
+        vec3 t = tan - n*(n*tan);
+        if (t.norm()<1e-6) // no usable tex coords around the vertex, any direction orthogonal to the normal
+            t = cross(n, std::abs(n.x)<.9 ? vec3{1,0,0} : vec3{0,1,0});
+        t.normalize();
+        const float w = cross(n, t)*bitan<0 ? -1 : 1;
+        return {t.x, t.y, t.z, w};
+    }
+
+    // per-vertex tangent frames in the spirit of MikkTSpace: the tangent and bitangent of every face (the directions of increasing u and v)
+    // are projected onto the tangent plane of its vertices and accumulated with the corner angles as weights, then the tangent is
+    // orthonormalized against the vertex normal and the handedness records on which side of it the accumulated bitangent lies;
+    // unlike MikkTSpace the vertices are not split where the frames of the faces disagree, the index buffer is kept as is
+    void build_tangents(Mesh &mesh) {
+        const int nverts = mesh.verts.size(), nfaces = mesh.facet.size()/3;
+        std::vector<vec3> tan(nverts, {0,0,0}), bitan(nverts, {0,0,0});
+        for (int f=0; f<nfaces; f++) {
+            const int *v = &mesh.facet[f*3];
+            const vec3 p[3]  = {mesh.verts[v[0]], mesh.verts[v[1]], mesh.verts[v[2]]};
+            const vec2 uv[3] = {mesh.tex_coord[v[0]], mesh.tex_coord[v[1]], mesh.tex_coord[v[2]]};
+            const vec3 *n[3] = {&mesh.norms[v[0]], &mesh.norms[v[1]], &mesh.norms[v[2]]};
+            vec3 *t[3] = {&tan[v[0]], &tan[v[1]], &tan[v[2]]}, *b[3] = {&bitan[v[0]], &bitan[v[1]], &bitan[v[2]]};
+            accumulate_frames(p, uv, n, t, b);
+        }
+        mesh.tangents.resize(nverts);
+#pragma omp parallel for
+        for (int i=0; i<nverts; i++)
+            mesh.tangents[i] = tangent_frame(mesh.norms[i], tan[i], bitan[i]);
+    }
+
+    constexpr int lod_min_faces = 32; // no level of detail is coarser than that
+
+    void build_lods(Mesh &mesh) {
+        const std::vector<SimplifiedLevel> levels = simplify(mesh.verts, mesh.facet, Model::max_lods, lod_min_faces);
+        mesh.nlods = levels.size();
+        for (int i=0; i<mesh.nlods; i++) {
+            mesh.lod_offsets[i] = mesh.lod_facet.size();
+            mesh.lod_errors[i]  = levels[i].error;
+            mesh.lod_facet.insert(mesh.lod_facet.end(), levels[i].indices.begin(), levels[i].indices.end());
+        }
+        mesh.lod_offsets[mesh.nlods] = mesh.lod_facet.size();
+    }
+
+    struct CornerHash {
+        std::size_t operator()(const std::array<int, 3> &c) const {
+            return (std::size_t(c[0])*73856093) ^ (std::size_t(c[1])*19349663) ^ (std::size_t(c[2])*83492791);
+        }
+    };
+
+    // the corner refers to parsed elements, its tex coord and normal may be missing
+    bool resolved(const int v, const int t, const int n, const std::size_t nverts, const std::size_t ntex, const std::size_t nnorms) {
+        return v>=0 && v<(int)nverts && (t==missing || (t>=0 && t<(int)ntex)) && (n==missing || (n>=0 && n<(int)nnorms));
+    }
+
+    vec3 face_normal(const vec3 &a, const vec3 &b, const vec3 &c) {
+        vec3 normal = cross(b-a, c-a);
+        return normal.norm()>0 ? normal.normalize() : vec3{0,0,1};
+    }
+
+    // a vertex is a unique (position, tex coord, normal) triple, it is shaded once no matter how many faces share it;
+    // the corners are given by their (resolved) indices in the obj arrays: a corner without a tex coord is mapped to (0,0),
+    // and the corners without a normal get the face normal
+    std::shared_ptr<Mesh> weld(const std::vector<vec3> &verts, const std::vector<vec2> &tex_coord, const std::vector<vec3> &norms,
+                               std::span<const int> facet_vrt, std::span<const int> facet_tex, std::span<const int> facet_nrm) {
+        auto mesh = std::make_shared<Mesh>();
+        std::unordered_map<std::array<int, 3>, int, CornerHash> unique;
+        unique.reserve(facet_vrt.size()/3);
+        mesh->facet.resize(facet_vrt.size());
+        for (std::size_t i=0; i<facet_vrt.size(); i++) {
+            const int f = i/3, t = facet_tex[i], n = facet_nrm[i]==missing ? -1-f : facet_nrm[i]; // a face normal is not shared with the other faces
+            auto [it, inserted] = unique.try_emplace({facet_vrt[i], t, n}, (int)mesh->verts.size());
+            if (inserted) {
+                mesh->verts.push_back(verts[facet_vrt[i]]);
+                mesh->tex_coord.push_back(t==missing ? vec2{0,0} : tex_coord[t]);
+                if (n<0)
+                    mesh->norms.push_back(face_normal(verts[facet_vrt[f*3]], verts[facet_vrt[f*3+1]], verts[facet_vrt[f*3+2]]));
+                else
+                    mesh->norms.push_back(norms[n]);
+            }
+            mesh->facet[i] = it->second;
+        }
+        return mesh;
+    }
+
+    constexpr const char *texture_suffix[3] = {"_diffuse.tga", "_nm_tangent.tga", "_spec.tga"};
+
+    // the binary cache is a header followed by the arrays in the in-memory layout of this build, each aligned to cache_align bytes
+    constexpr std::uint32_t cache_version = 7;
+    constexpr std::size_t cache_align = 64;
+
+    struct CacheHeader {
+        char magic[8] = {'T','R','M','E','S','H','\0','\0'};
+        std::uint32_t version = cache_version;
+        std::uint32_t layout  = sizeof(vec2) | sizeof(vec3)<<8 | sizeof(int)<<16 | sizeof(Model::BVHNode)<<24;
+        std::uint64_t stamps[4][2]{};   // mtime and size of the obj file and of the three textures the cache was built from
+        std::uint64_t counts[3]{};      // number of vertices, length of the index buffer and number of bvh nodes
+        std::uint32_t lods = 0;         // number of coarser levels of detail, their offsets in the lod section and distance bounds
+        std::uint32_t lods_built = 0;   // the levels were generated, a model loaded without them has lods = 0 as a too small mesh does
+        std::uint32_t lod_offsets[Model::max_lods+1]{};
+        float lod_errors[Model::max_lods]{};
+        std::uint32_t textures[3][2]{}; // width and height, the textures are stored as their tiled mip chains
+        std::uint64_t file_size = 0;
+        std::uint64_t checksum  = 0;    // FNV-1a of all the fields above
+    };
+
+    std::uint64_t fnv1a(const void *data, const std::size_t size) {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (std::size_t i=0; i<size; i++)
+            hash = (hash ^ static_cast<const std::uint8_t *>(data)[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    std::uint64_t header_checksum(const CacheHeader &h) {
+        return fnv1a(&h, offsetof(CacheHeader, checksum));
+    }
+
+    constexpr int cache_sections = 11;
+
+    // byte offsets of the 11 sections (5 mesh arrays, 2 bvh arrays, the lod index buffers and 3 textures) and the total file size
+    std::array<std::size_t, cache_sections+1> cache_layout(const CacheHeader &h) {
+        const std::size_t sizes[cache_sections] = {
+            h.counts[0]*sizeof(vec3), h.counts[0]*sizeof(vec2), h.counts[0]*sizeof(vec3), h.counts[0]*sizeof(vec4), h.counts[1]*sizeof(int),
+            h.counts[2]*sizeof(Model::BVHNode), h.counts[1]/3*sizeof(int), h.lod_offsets[std::min<std::uint32_t>(h.lods, Model::max_lods)]*sizeof(int),
+            Texture::size(h.textures[0][0], h.textures[0][1])*sizeof(std::uint32_t),
+            Texture::size(h.textures[1][0], h.textures[1][1])*sizeof(std::uint32_t),
+            Texture::size(h.textures[2][0], h.textures[2][1])*sizeof(std::uint32_t) };
+        std::array<std::size_t, cache_sections+1> offsets;
+        offsets[0] = (sizeof(CacheHeader)+cache_align-1)/cache_align*cache_align;
+        for (int i=0; i<cache_sections; i++)
+            offsets[i+1] = (offsets[i]+sizes[i]+cache_align-1)/cache_align*cache_align;
+        return offsets;
+    }
+
+    // the header only tells the sizes of the sections: a damaged body must not make the renderer index out of range, the index buffers,
+    // the bvh and the level offsets are range-checked in one linear pass over the mapping, still much cheaper than a parse
+    bool valid_cache_body(const std::size_t nverts, std::span<const int> facet, std::span<const Model::BVHNode> nodes, std::span<const int> node_faces,
+                          std::span<const int> lod_facet, const std::uint32_t *lod_offsets, const std::uint32_t nlods) {
+        const std::size_t nfaces = facet.size()/3, nnodes = nodes.size();
+        auto in_range = [](std::span<const int> indices, const std::size_t n) {
+            return std::all_of(indices.begin(), indices.end(), [n](const int i) { return i>=0 && std::size_t(i)<n; });
+        };
+        if (facet.size()%3 || !in_range(facet, nverts) || !in_range(lod_facet, nverts) || !in_range(node_faces, nfaces) || (nfaces && !nnodes))
+            return false;
+        if (lod_offsets[0]) return false;
+        for (std::uint32_t i=0; i<nlods; i++)
+            if (lod_offsets[i]>lod_offsets[i+1] || lod_offsets[i+1]%3) return false;
+        // the nodes are in depth-first order: the subtree of a node ends where the one of its right child does, and the left child
+        // ends where the right one begins; the depth bounds the traversal stack, see the bvh walk of render()
+        std::vector<std::uint32_t> end(nnodes), depth(nnodes);
+        for (std::size_t i=nnodes; i-->0;) {
+            const Model::BVHNode &n = nodes[i];
+            if (n.count) {
+                if (n.count<0 || n.first<0 || std::size_t(n.first)+n.count>nfaces) return false;
+                end[i] = i+1;
+                depth[i] = 1;
+                continue;
+            }
+            if (n.first<=int(i)+1 || std::size_t(n.first)>=nnodes || end[i+1]!=std::uint32_t(n.first)) return false;
+            end[i] = end[n.first];
+            depth[i] = 1 + std::max(depth[i+1], depth[n.first]);
+        }
+        return !nnodes || (end[0]==nnodes && depth[0]<Model::max_bvh_depth);
+    }
+
+    // stamps of the files the cache depends on, a missing file gets zero stamps
+    void source_stamps(const std::string &filename, std::uint64_t stamps[4][2]) {
+        const std::string base = filename.substr(0, filename.find_last_of("."));
+        for (int i=0; i<4; i++) {
+            const std::filesystem::path path = i ? base + texture_suffix[i-1] : filename;
+            std::error_code ec;
+            auto mtime = std::filesystem::last_write_time(path, ec);
+            stamps[i][0] = ec ? 0 : mtime.time_since_epoch().count();
+            auto size = std::filesystem::file_size(path, ec);
+            stamps[i][1] = ec ? 0 : size;
+        }
+    }
+
+    const char *skip_blanks(const char *p, const char *end) {
+        while (p<end && (*p==' ' || *p=='\t' || *p=='\r')) p++;
+        return p;
+    }
+
+    bool parse_float(const char *&p, const char *end, float &v) {
+        p = skip_blanks(p, end);
+        if (p<end && *p=='+') p++; // from_chars does not accept the plus sign
+        auto [next, ec] = std::from_chars(p, end, v);
+        if (ec!=std::errc()) return false;
+        p = next;
+        return true;
+    }
+
+    bool parse_int(const char *&p, const char *end, int &v) {
+        auto [next, ec] = std::from_chars(p, end, v);
+        if (ec!=std::errc()) return false;
+        p = next;
+        return true;
+    }
+
+    // obj indices are 1-based, negative ones count back from the last element read so far
+    void push_index(const int idx, const std::size_t count, std::vector<int> &facet, std::vector<std::size_t> &relative) {
+        if (idx<0) {
+            relative.push_back(facet.size());
+            facet.push_back(count+idx);
+        } else
+            facet.push_back(idx ? idx-1 : missing);
+    }
+
+    void parse_face(const char *p, const char *end, Chunk &c) {
+        int corners[3][64], n = 0; // v, vt, vn indices of the polygon corners
+        while (true) {
+            p = skip_blanks(p, end);
+            if (p>=end || *p=='#') break;
+            int v, t = missing, nrm = missing;
+            if (!parse_int(p, end, v)) { c.bad_faces++; return; }
+            if (p<end && *p=='/') {
+                p++;
+                if (p<end && *p!='/' && !parse_int(p, end, t)) { c.bad_faces++; return; }
+                if (p<end && *p=='/' && (++p, !parse_int(p, end, nrm))) { c.bad_faces++; return; }
+            }
+            if (n==64) { c.bad_faces++; return; }
+            corners[0][n] = v; corners[1][n] = t; corners[2][n] = nrm;
+            n++;
+        }
+        if (n<3) { c.bad_faces++; return; }
+        for (int i=1; i+1<n; i++) // fan triangulation of quads and n-gons
+            for (int k : {0, i, i+1}) {
+                push_index(corners[0][k], c.verts.size(), c.facet_vrt, c.relative_vrt);
+                if (corners[1][k]==missing) c.facet_tex.push_back(missing); else push_index(corners[1][k], c.tex_coord.size(), c.facet_tex, c.relative_tex);
+                if (corners[2][k]==missing) c.facet_nrm.push_back(missing); else push_index(corners[2][k], c.norms.size(),     c.facet_nrm, c.relative_nrm);
+            }
+    }
+
+    void parse_chunk(const char *p, const char *end, Chunk &c) {
+        while (p<end) {
+            const char *eol = static_cast<const char *>(std::memchr(p, '\n', end-p));
+            if (!eol) eol = end;
+            const char *q = skip_blanks(p, eol);
+            if (eol-q>1 && q[0]=='v' && (q[1]==' ' || q[1]=='\t')) {
+                q += 2;
+                vec3 v;
+                for (int i=0; i<3; i++) parse_float(q, eol, v[i]);
+                c.verts.push_back(v);
+            } else if (eol-q>2 && q[0]=='v' && q[1]=='n' && (q[2]==' ' || q[2]=='\t')) {
+                q += 3;
+                vec3 n;
+                for (int i=0; i<3; i++) parse_float(q, eol, n[i]);
+                c.norms.push_back(n.normalize());
+            } else if (eol-q>2 && q[0]=='v' && q[1]=='t' && (q[2]==' ' || q[2]=='\t')) {
+                q += 3;
+                vec2 uv;
+                for (int i=0; i<2; i++) parse_float(q, eol, uv[i]);
+                c.tex_coord.push_back({uv.x, 1-uv.y});
+            } else if (eol-q>1 && q[0]=='f' && (q[1]==' ' || q[1]=='\t'))
+                parse_face(q+2, eol, c);
+            p = eol+1;
+        }
+    }
+}
+
+Model::Model(const std::string filename, const bool lods) {
+    PROFILE_SCOPE("load model");
+    if (!read_cache(filename, lods)) {
+        load_obj(filename, lods);
+        write_cache(filename, lods);
+    }
+    std::cerr << "# v# " << nverts() << " f# "  << nfaces() << std::endl;
+}
+
+void Model::load_obj(const std::string &filename, const bool lods) {
+    PROFILE_SCOPE("parse obj");
+    FileView file(filename);
+    if (!file.data()) return;
+    std::vector<vec3> verts, norms;
+    std::vector<vec2> tex_coord;
+    std::vector<int> facet_vrt, facet_tex, facet_nrm;
+    const char *begin = file.data(), *end = begin + file.size();
+    std::vector<const char *> bounds = {begin}; // chunks are split at line boundaries
+    while (end-bounds.back() > (std::ptrdiff_t)chunk_size) {
+        const char *eol = static_cast<const char *>(std::memchr(bounds.back()+chunk_size, '\n', end-bounds.back()-chunk_size));
+        if (!eol) break;
+        bounds.push_back(eol+1);
+    }
+    bounds.push_back(end);
+    const int nchunks = bounds.size()-1;
+    std::vector<Chunk> chunks(nchunks);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i=0; i<nchunks; i++)
+        parse_chunk(bounds[i], bounds[i+1], chunks[i]);
+
+    // stitch the chunks together, offsets of every chunk in the final arrays are the prefix sums of the chunk sizes
+    std::vector<std::size_t> vbase(nchunks+1, 0), tbase(nchunks+1, 0), nbase(nchunks+1, 0), fbase(nchunks+1, 0);
+    std::size_t bad_faces = 0;
+    for (int i=0; i<nchunks; i++) {
+        vbase[i+1] = vbase[i] + chunks[i].verts.size();
+        tbase[i+1] = tbase[i] + chunks[i].tex_coord.size();
+        nbase[i+1] = nbase[i] + chunks[i].norms.size();
+        fbase[i+1] = fbase[i] + chunks[i].facet_vrt.size();
+        bad_faces += chunks[i].bad_faces;
+    }
+    verts.resize(vbase[nchunks]);
+    tex_coord.resize(tbase[nchunks]);
+    norms.resize(nbase[nchunks]);
+    facet_vrt.resize(fbase[nchunks]);
+    facet_tex.resize(fbase[nchunks]);
+    facet_nrm.resize(fbase[nchunks]);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i=0; i<nchunks; i++) {
+        Chunk &c = chunks[i];
+        std::copy(c.verts.begin(),     c.verts.end(),     verts.begin()     + vbase[i]);
+        std::copy(c.tex_coord.begin(), c.tex_coord.end(), tex_coord.begin() + tbase[i]);
+        std::copy(c.norms.begin(),     c.norms.end(),     norms.begin()     + nbase[i]);
+        for (std::size_t j : c.relative_vrt) c.facet_vrt[j] += vbase[i];
+        for (std::size_t j : c.relative_tex) c.facet_tex[j] += tbase[i];
+        for (std::size_t j : c.relative_nrm) c.facet_nrm[j] += nbase[i];
+        std::copy(c.facet_vrt.begin(), c.facet_vrt.end(), facet_vrt.begin() + fbase[i]);
+        std::copy(c.facet_tex.begin(), c.facet_tex.end(), facet_tex.begin() + fbase[i]);
+        std::copy(c.facet_nrm.begin(), c.facet_nrm.end(), facet_nrm.begin() + fbase[i]);
+        c = Chunk();
+    }
+    if (bad_faces)
+        std::cerr << "Warning: " << bad_faces << " malformed faces skipped" << std::endl;
+
+    std::size_t kept = 0; // the faces referring to non-existent vertices are skipped, the others are compacted in place
+    for (std::size_t i=0; i<facet_vrt.size(); i+=3) {
+        bool valid = true;
+        for (std::size_t k=i; k<i+3; k++)
+            valid &= resolved(facet_vrt[k], facet_tex[k], facet_nrm[k], verts.size(), tex_coord.size(), norms.size());
+        if (!valid) continue;
+        for (std::size_t k=i; k<i+3; k++, kept++) {
+            facet_vrt[kept] = facet_vrt[k];
+            facet_tex[kept] = facet_tex[k];
+            facet_nrm[kept] = facet_nrm[k];
+        }
+    }
+    if (kept<facet_vrt.size())
+        std::cerr << "Error: " << (facet_vrt.size()-kept)/3 << " faces of the obj file refer to non-existent vertices, skipped" << std::endl;
+    facet_vrt.resize(kept);
+    facet_tex.resize(kept);
+    facet_nrm.resize(kept);
+    const std::shared_ptr<Mesh> mesh = weld(verts, tex_coord, norms, facet_vrt, facet_tex, facet_nrm);
+    build_tangents(*mesh);
+    build_bvh(*mesh);
+    if (lods) build_lods(*mesh);
+    assign(mesh);
+    for (int i : {0,1,2})
+        load_texture(filename, texture_suffix[i], *textures()[i]);
+}
+
+void Model::assign(std::shared_ptr<const Mesh> mesh) {
+    verts      = mesh->verts;
+    tex_coord  = mesh->tex_coord;
+    norms      = mesh->norms;
+    tangents   = mesh->tangents;
+    facet      = mesh->facet;
+    nodes      = mesh->nodes;
+    node_faces = mesh->node_faces;
+    lod_facet  = mesh->lod_facet;
+    nlods       = mesh->nlods;
+    lod_offsets = mesh->lod_offsets;
+    lod_errors  = mesh->lod_errors;
+    storage = std::move(mesh);
+}
+
+bool Model::read_cache(const std::string &filename, const bool lods) {
+    PROFILE_SCOPE("read cache");
+    const std::string cachefile = filename + ".cache";
+    auto file = std::make_shared<const FileView>(cachefile);
+    if (!file->data() || file->size()<sizeof(CacheHeader)) return false;
+    CacheHeader h, expected;
+    std::memcpy(&h, file->data(), sizeof(h));
+    source_stamps(filename, expected.stamps);
+    if (std::memcmp(h.magic, expected.magic, sizeof(h.magic)) || h.version!=expected.version || h.layout!=expected.layout ||
+        h.checksum!=header_checksum(h) || std::memcmp(h.stamps, expected.stamps, sizeof(h.stamps)) ||
+        h.lods>max_lods || h.file_size!=file->size() || cache_layout(h)[cache_sections]!=h.file_size) {
+        std::cerr << "cache file " << cachefile << " is stale or corrupted" << std::endl;
+        return false;
+    }
+    if (lods && !h.lods_built) {
+        std::cerr << "cache file " << cachefile << " has no levels of detail" << std::endl;
+        return false;
+    }
+    const std::array<std::size_t, cache_sections+1> offsets = cache_layout(h);
+    const char *base = file->data();
+    if (!valid_cache_body(h.counts[0], {reinterpret_cast<const int *>(base+offsets[4]), h.counts[1]}, {reinterpret_cast<const BVHNode *>(base+offsets[5]), h.counts[2]},
+                          {reinterpret_cast<const int *>(base+offsets[6]), h.counts[1]/3}, {reinterpret_cast<const int *>(base+offsets[7]), h.lod_offsets[h.lods]},
+                          h.lod_offsets, h.lods)) {
+        std::cerr << "cache file " << cachefile << " is corrupted" << std::endl;
+        return false;
+    }
+    verts      = {reinterpret_cast<const vec3 *>(base+offsets[0]), h.counts[0]}; // the arrays point directly into the mapping
+    tex_coord  = {reinterpret_cast<const vec2 *>(base+offsets[1]), h.counts[0]};
+    norms      = {reinterpret_cast<const vec3 *>(base+offsets[2]), h.counts[0]};
+    tangents   = {reinterpret_cast<const vec4 *>(base+offsets[3]), h.counts[0]};
+    facet      = {reinterpret_cast<const int  *>(base+offsets[4]), h.counts[1]};
+    nodes      = {reinterpret_cast<const BVHNode *>(base+offsets[5]), h.counts[2]};
+    node_faces = {reinterpret_cast<const int  *>(base+offsets[6]), h.counts[1]/3};
+    lod_facet  = {reinterpret_cast<const int  *>(base+offsets[7]), h.lod_offsets[h.lods]};
+    nlods = h.lods;
+    std::copy(h.lod_offsets, h.lod_offsets+max_lods+1, lod_offsets.begin());
+    std::copy(h.lod_errors,  h.lod_errors +max_lods,   lod_errors.begin());
+    for (int i : {0,1,2}) {
+        if (!h.textures[i][0]) continue;
+        const std::span<const std::uint32_t> texels = {reinterpret_cast<const std::uint32_t *>(base+offsets[8+i]), Texture::size(h.textures[i][0], h.textures[i][1])};
+        *textures()[i] = Texture(h.textures[i][0], h.textures[i][1], texels, file); // no tga parsing, no mipmap building
+    }
+    storage = file;
+    std::cerr << "cache file " << cachefile << " loaded" << std::endl;
+    return true;
+}
+
+void Model::write_cache(const std::string &filename, const bool lods) const {
+    PROFILE_SCOPE("write cache");
+    if (verts.empty()) return;
+    CacheHeader h;
+    source_stamps(filename, h.stamps);
+    h.counts[0] = verts.size();
+    h.counts[1] = facet.size();
+    h.counts[2] = nodes.size();
+    h.lods = nlods;
+    h.lods_built = lods;
+    std::copy(lod_offsets.begin(), lod_offsets.end(), h.lod_offsets);
+    std::copy(lod_errors.begin(),  lod_errors.end(),  h.lod_errors);
+    const Texture *maps[3] = {&diffusemap, &normalmap, &specularmap};
+    for (int i : {0,1,2}) {
+        h.textures[i][0] = maps[i]->width();
+        h.textures[i][1] = maps[i]->height();
+    }
+    const std::array<std::size_t, cache_sections+1> offsets = cache_layout(h);
+    h.file_size = offsets[cache_sections];
+    h.checksum  = header_checksum(h);
+
+    const std::string cachefile = filename + ".cache", tmpfile = cachefile + ".tmp";
+    std::ofstream out(tmpfile, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't write the cache file " << cachefile << std::endl;
+        return;
+    }
+    const void *sections[cache_sections] = {verts.data(), tex_coord.data(), norms.data(), tangents.data(), facet.data(), nodes.data(), node_faces.data(), lod_facet.data(),
+                                            maps[0]->data().data(), maps[1]->data().data(), maps[2]->data().data()};
+    const std::size_t sizes[cache_sections] = {verts.size_bytes(), tex_coord.size_bytes(), norms.size_bytes(), tangents.size_bytes(), facet.size_bytes(),
+                                               nodes.size_bytes(), node_faces.size_bytes(), lod_facet.size_bytes(),
+                                               maps[0]->data().size_bytes(), maps[1]->data().size_bytes(), maps[2]->data().size_bytes()};
+    const char padding[cache_align] = {};
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    out.write(padding, offsets[0]-sizeof(h));
+    for (int i=0; i<cache_sections; i++) {
+        out.write(static_cast<const char *>(sections[i]), sizes[i]);
+        out.write(padding, offsets[i+1]-offsets[i]-sizes[i]);
+    }
+    out.close();
+    std::error_code ec;
+    if (!out.good() || (std::filesystem::rename(tmpfile, cachefile, ec), ec)) { // rename is atomic, a cache file is never seen half-written
+        std::cerr << "can't write the cache file " << cachefile << std::endl;
+        std::filesystem::remove(tmpfile, ec);
+    }
 }
 
 int Model::nverts() const {
@@ -55,7 +646,20 @@ int Model::nverts() const {
 }
 
 int Model::nfaces() const {
-    return facet_vrt.size()/3;
+    return facet.size()/3;
+}
+
+int Model::index(const int iface, const int nthvert) const {
+    return facet[iface*3+nthvert];
+}
+
+std::span<const int> Model::lod(const int level) const {
+    if (!level) return facet;
+    return lod_facet.subspan(lod_offsets[level-1], lod_offsets[level]-lod_offsets[level-1]);
+}
+
+float Model::lod_error(const int level) const {
+    return level ? lod_errors[level-1] : 0;
 }
 
 vec3 Model::vert(const int i) const {
@@ -63,26 +667,240 @@ vec3 Model::vert(const int i) const {
 }
 
 vec3 Model::vert(const int iface, const int nthvert) const {
-    return verts[facet_vrt[iface*3+nthvert]];
+    return verts[facet[iface*3+nthvert]];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img) {
+void Model::load_texture(std::string filename, const std::string suffix, Texture &tex) {
     size_t dot = filename.find_last_of(".");
     if (dot==std::string::npos) return;
     std::string texfile = filename.substr(0,dot) + suffix;
-    std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
+    TGAImage img;
+    const bool ok = img.read_tga_file(texfile.c_str());
+    std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
+    if (ok) tex = Texture(img);
 }
 
 vec3 Model::normal(const vec2 &uvf) const {
-    TGAColor c = normalmap.get(uvf[0]*normalmap.width(), uvf[1]*normalmap.height());
-    return vec3{(double)c[2],(double)c[1],(double)c[0]}*2./255. - vec3{1,1,1};
+    const vec4 c = normalmap.sample(uvf);
+    return vec3{c[2],c[1],c[0]}*2.f/255.f - vec3{1,1,1};
+}
+
+vec3 Model::normal(const vec2 &uvf, const vec2 &duvdx, const vec2 &duvdy) const {
+    const vec4 c = normalmap.sample(uvf, duvdx, duvdy);
+    return vec3{c[2],c[1],c[0]}*2.f/255.f - vec3{1,1,1};
+}
+
+vec2 Model::uv(const int i) const {
+    return tex_coord[i];
 }
 
 vec2 Model::uv(const int iface, const int nthvert) const {
-    return tex_coord[facet_tex[iface*3+nthvert]];
+    return tex_coord[facet[iface*3+nthvert]];
+}
+
+vec3 Model::normal(const int i) const {
+    return norms[i];
 }
 
 vec3 Model::normal(const int iface, const int nthvert) const {
-    return norms[facet_nrm[iface*3+nthvert]];
+    return norms[facet[iface*3+nthvert]];
 }
 
+vec4 Model::tangent(const int i) const {
+    return tangents[i];
+}
+
+vec4 Model::tangent(const int iface, const int nthvert) const {
+    return tangents[facet[iface*3+nthvert]];
+}
+
+struct ModelStream::Queue {
+    std::mutex mutex;
+    std::condition_variable changed; // a batch was pushed or popped, the parse has ended or is stopped
+    std::deque<Model> batches{};
+    std::size_t capacity = 0;
+    bool done = false, stopped = false;
+};
+
+ModelStream::ModelStream(const std::string filename, const int capacity) : queue(std::make_unique<Queue>()) {
+    queue->capacity = std::max(capacity, 1);
+    parser = std::thread(parse, filename, std::ref(*queue));
+    for (int i : {0,1,2}) // meanwhile the first batches are parsed
+        Model::load_texture(filename, texture_suffix[i], maps[i]);
+}
+
+ModelStream::~ModelStream() {
+    {
+        std::lock_guard lock(queue->mutex);
+        queue->stopped = true;
+    }
+    queue->changed.notify_all();
+    parser.join();
+}
+
+std::optional<Model> ModelStream::next() {
+    std::unique_lock lock(queue->mutex);
+    queue->changed.wait(lock, [this]() { return !queue->batches.empty() || queue->done; });
+    if (queue->batches.empty()) return std::nullopt;
+    std::optional<Model> batch = std::move(queue->batches.front());
+    queue->batches.pop_front();
+    lock.unlock();
+    queue->changed.notify_all(); // the parser may go on
+    batch->diffusemap  = maps[0];
+    batch->normalmap   = maps[1];
+    batch->specularmap = maps[2];
+    return batch;
+}
+
+void ModelStream::parse(const std::string filename, Queue &queue) {
+    PROFILE_SCOPE("stream obj");
+    struct Corners { std::vector<int> vrt{}, tex{}, nrm{}; int first_face = 0; std::size_t seq = 0; };
+    struct Frame { int tex, nrm, next; std::size_t last; vec3 tan, bitan; }; // last: the last held batch referring to the vertex
+    FileView file(filename);
+    std::vector<vec3> verts, norms; // all the attributes parsed so far, the faces further down may refer to any of them
+    std::vector<vec2> tex_coord;
+    Corners pending;                // faces referring to attributes not parsed yet, in the file order
+    std::deque<Corners> held;       // batches waiting for the faces further down to complete the tangent frames of their vertices
+    // tangent frame sums of the vertices of the held batches, welded like weld() does but with the face normals told apart across
+    // the batches: the faces are accumulated in the order build_tangents() sees them, the frames of a whole load are matched exactly
+    // unless the faces around a vertex are further apart than frame_lookahead batches. The sums live in a pool, chained per obj
+    // position, and are released with the last batch referring to them: the pool holds the vertices of a few batches only
+    std::vector<Frame> frames;
+    std::vector<int> spare;         // free slots of the pool
+    std::vector<int> chain;         // per obj position, its first vertex in the pool, -1 if none
+    std::vector<bool> drawn;        // per obj position, a batch referring to it was handed out: the faces further down come too late
+    std::size_t bad_faces = 0, broken = 0, nfaces = 0, nbatches = 0, nready = 0, nheld = 0, late = 0;
+
+    auto find = [&](const Corners &batch, const std::size_t i) { // the pool slot of a corner, -1 if none
+        const int t = batch.tex[i], n = batch.nrm[i]==missing ? -1-batch.first_face-int(i/3) : batch.nrm[i];
+        int slot = chain[batch.vrt[i]];
+        while (slot>=0 && (frames[slot].tex!=t || frames[slot].nrm!=n)) slot = frames[slot].next;
+        return slot;
+    };
+    auto find_or_add = [&](const Corners &batch, const std::size_t i) {
+        int slot = find(batch, i);
+        if (slot>=0) return slot;
+        const Frame frame = {batch.tex[i], batch.nrm[i]==missing ? -1-batch.first_face-int(i/3) : batch.nrm[i], chain[batch.vrt[i]], 0, {0,0,0}, {0,0,0}};
+        if (spare.empty()) {
+            slot = frames.size();
+            frames.push_back(frame);
+        } else {
+            slot = spare.back();
+            spare.pop_back();
+            frames[slot] = frame;
+        }
+        return chain[batch.vrt[i]] = slot;
+    };
+    auto accumulate = [&](const Corners &batch) {
+        for (std::size_t i=0; i<batch.vrt.size(); i+=3) {
+            vec3 p[3], normal[3];
+            vec2 uv[3];
+            const vec3 *n[3];
+            vec3 *t[3], *b[3];
+            int slot[3];
+            bool too_late = false;
+            for (int k : {0,1,2}) {
+                p[k]  = verts[batch.vrt[i+k]];
+                uv[k] = batch.tex[i+k]==missing ? vec2{0,0} : tex_coord[batch.tex[i+k]];
+                slot[k] = find_or_add(batch, i+k); // may grow the pool, the pointers are taken below
+                frames[slot[k]].last = batch.seq;
+                too_late |= drawn[batch.vrt[i+k]];
+            }
+            late += too_late;
+            for (int k : {0,1,2}) {
+                normal[k] = batch.nrm[i+k]==missing ? face_normal(p[0], p[1], p[2]) : norms[batch.nrm[i+k]];
+                n[k] = &normal[k];
+                t[k] = &frames[slot[k]].tan;
+                b[k] = &frames[slot[k]].bitan;
+            }
+            accumulate_frames(p, uv, n, t, b);
+        }
+    };
+    auto emit = [&](const Corners &batch) {
+        const std::shared_ptr<Model::Mesh> mesh = weld(verts, tex_coord, norms, batch.vrt, batch.tex, batch.nrm);
+        mesh->tangents.resize(mesh->verts.size());
+        for (std::size_t i=0; i<batch.vrt.size(); i++) {
+            const Frame &frame = frames[find(batch, i)];
+            const int v = mesh->facet[i];
+            mesh->tangents[v] = tangent_frame(mesh->norms[v], frame.tan, frame.bitan);
+            drawn[batch.vrt[i]] = true;
+        }
+        for (const int v : batch.vrt) // release the vertices no later held batch refers to
+            for (int *link = &chain[v]; *link>=0;) {
+                const int slot = *link;
+                if (frames[slot].last!=batch.seq) { link = &frames[slot].next; continue; }
+                *link = frames[slot].next;
+                spare.push_back(slot);
+            }
+        Model model;
+        model.assign(mesh);
+        nfaces += model.nfaces();
+        nbatches++;
+        std::unique_lock lock(queue.mutex);
+        queue.changed.wait(lock, [&queue]() { return queue.batches.size()<queue.capacity || queue.stopped; });
+        if (queue.stopped) return false;
+        queue.batches.push_back(std::move(model));
+        lock.unlock();
+        queue.changed.notify_all();
+        return true;
+    };
+    const char *p = file.data(), *end = p + file.size();
+    while (p<end) {
+        const char *next = end; // the pieces are split at line boundaries
+        if (end-p > (std::ptrdiff_t)piece_size)
+            if (const char *eol = static_cast<const char *>(std::memchr(p+piece_size, '\n', end-p-piece_size))) next = eol+1;
+        Chunk c;
+        parse_chunk(p, next, c);
+        p = next;
+        file.release(p);
+        for (std::size_t j : c.relative_vrt) c.facet_vrt[j] += verts.size();
+        for (std::size_t j : c.relative_tex) c.facet_tex[j] += tex_coord.size();
+        for (std::size_t j : c.relative_nrm) c.facet_nrm[j] += norms.size();
+        verts.insert(verts.end(), c.verts.begin(), c.verts.end());
+        tex_coord.insert(tex_coord.end(), c.tex_coord.begin(), c.tex_coord.end());
+        norms.insert(norms.end(), c.norms.begin(), c.norms.end());
+        chain.resize(verts.size(), -1);
+        drawn.resize(verts.size());
+        bad_faces += c.bad_faces;
+
+        Corners batch, waiting;
+        auto dispatch = [&](const std::vector<int> &vrt, const std::vector<int> &tex, const std::vector<int> &nrm) {
+            for (std::size_t i=0; i<vrt.size(); i+=3) {
+                bool ready = true, negative = false;
+                for (std::size_t k=i; k<i+3; k++) {
+                    ready &= resolved(vrt[k], tex[k], nrm[k], verts.size(), tex_coord.size(), norms.size());
+                    negative |= vrt[k]<0 || (tex[k]!=missing && tex[k]<0) || (nrm[k]!=missing && nrm[k]<0); // counts back past the start of the file
+                }
+                if (negative) { broken++; continue; }
+                Corners &dst = ready ? batch : waiting;
+                dst.vrt.insert(dst.vrt.end(), vrt.begin()+i, vrt.begin()+i+3);
+                dst.tex.insert(dst.tex.end(), tex.begin()+i, tex.begin()+i+3);
+                dst.nrm.insert(dst.nrm.end(), nrm.begin()+i, nrm.begin()+i+3);
+            }
+        };
+        dispatch(pending.vrt, pending.tex, pending.nrm);
+        dispatch(c.facet_vrt, c.facet_tex, c.facet_nrm);
+        pending = std::move(waiting);
+        if (!batch.vrt.empty()) {
+            batch.first_face = nready;
+            batch.seq = nheld++;
+            nready += batch.vrt.size()/3;
+            accumulate(batch);
+            held.push_back(std::move(batch));
+        }
+        for (; held.size()>frame_lookahead; held.pop_front())
+            if (!emit(held.front())) return;
+    }
+    for (; !held.empty(); held.pop_front())
+        if (!emit(held.front())) return;
+    if (bad_faces)
+        std::cerr << "Warning: " << bad_faces << " malformed faces skipped" << std::endl;
+    if (broken || !pending.vrt.empty())
+        std::cerr << "Error: " << broken + pending.vrt.size()/3 << " faces of the obj file refer to non-existent vertices, skipped" << std::endl;
+    if (late)
+        std::cerr << "Warning: " << late << " faces came after their vertices were drawn, the tangent frames around them are partial" << std::endl;
+    std::cerr << "# streamed f# " << nfaces << " in " << nbatches << " batches" << std::endl;
+    std::lock_guard lock(queue.mutex);
+    queue.done = true;
+    queue.changed.notify_all();
+}
@@ -1,29 +1,97 @@
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <thread>
 #include <vector>
 #include <string>
 #include "geometry.h"
-#include "tgaimage.h"
+#include "texture.h"
 
 class Model {
-    std::vector<vec3> verts{};     // array of vertices
-    std::vector<vec2> tex_coord{}; // per-vertex array of tex coords
-    std::vector<vec3> norms{};     // per-vertex array of normal vectors
-    std::vector<int> facet_vrt{};
-    std::vector<int> facet_tex{};  // per-triangle indices in the above arrays
-    std::vector<int> facet_nrm{};
-    TGAImage diffusemap{};         // diffuse color texture
-    TGAImage normalmap{};          // normal map texture
-    TGAImage specularmap{};        // specular map texture
-    void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
 public:
-    Model(const std::string filename);
+    static constexpr int max_lods = 8; // coarser levels of detail generated for every model, each with half the faces of the previous one
+    static constexpr int max_bvh_depth = 64; // bounds the traversal stack, the tree is balanced and its depth is logarithmic
+    struct BVHNode { // bounding box of a subtree, the nodes are stored in depth-first order
+        vec3 bbox_min, bbox_max;
+        int first; // leaf: offset of its faces in bvh_faces(); inner node: index of the right child, the left one is the next node
+        int count; // number of faces of a leaf, 0 for an inner node
+    };
+    struct Mesh; // the arrays of a model parsed from an obj file, see model.cpp
+private:
+    std::shared_ptr<const void> storage{}; // owns the memory the arrays below point to: the parsed obj data or the mapped cache file
+    std::span<const vec3> verts{};     // array of vertex positions
+    std::span<const vec2> tex_coord{}; // per-vertex array of tex coords
+    std::span<const vec3> norms{};     // per-vertex array of normal vectors
+    std::span<const vec4> tangents{};  // per-vertex tangent (direction of increasing u, orthogonal to the normal) and handedness in w
+    std::span<const int> facet{};      // per-triangle indices in the above arrays, a vertex is a unique (position, tex coord, normal) triple
+    std::span<const BVHNode> nodes{};  // bounding volume hierarchy over the faces, the root is the first node
+    std::span<const int> node_faces{}; // face indices grouped by leaf
+    std::span<const int> lod_facet{};  // index buffers of the coarser levels of detail one after another, into the same vertex arrays
+    int nlods = 0;                                      // number of coarser levels
+    std::array<std::uint32_t, max_lods+1> lod_offsets{}; // offset of every level in lod_facet, and the end of the last one
+    std::array<float, max_lods> lod_errors{};            // geometric error of every level, see simplify()
+    Texture diffusemap{};          // diffuse color texture
+    Texture normalmap{};           // normal map texture
+    Texture specularmap{};         // specular map texture
+    std::array<Texture*, 3> textures() { return {&diffusemap, &normalmap, &specularmap}; }
+    static void load_texture(const std::string filename, const std::string suffix, Texture &tex);
+    void load_obj(const std::string &filename, const bool lods);
+    void assign(std::shared_ptr<const Mesh> mesh); // points the arrays to the mesh, which the model keeps alive
+    Model() = default;
+    friend class ModelStream;
+    bool read_cache(const std::string &filename, const bool lods);        // maps filename.cache if it is up to date with the obj file and its textures,
+                                                                          // and has the levels of detail if they are asked for
+    void write_cache(const std::string &filename, const bool lods) const; // dumps the model to filename.cache
+public:
+    // lods: generate the levels of detail, the costliest part of a cache miss; they are still used if the cache has them
+    Model(const std::string filename, const bool lods = true);
     int nverts() const;
     int nfaces() const;
+    int index(const int iface, const int nthvert) const;   // vertex index of a triangle corner
+    std::span<const int> indices() const { return facet; } // the whole index buffer, 3 indices per triangle
+    std::span<const BVHNode> bvh() const { return nodes; }    // empty for a model without faces
+    std::span<const int> bvh_faces() const { return node_faces; }
+    int lods() const { return 1 + nlods; }           // number of levels of detail, 0 is the full mesh
+    std::span<const int> lod(const int level) const; // index buffer of a level, lod(0) is indices(); the faces are not in the bvh
+    float lod_error(const int level) const;          // distance between the level and the full mesh, in model units
+    vec3 normal(const int i) const;
     vec3 normal(const int iface, const int nthvert) const; // per triangle corner normal vertex
     vec3 normal(const vec2 &uv) const;                     // fetch the normal vector from the normal map texture
+    vec3 normal(const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy) const; // same, filtered over the pixel footprint
+    // tangent frame of the normal map: xyz is the unit tangent, w = +-1 the handedness, the bitangent is w*cross(normal, tangent)
+    vec4 tangent(const int i) const;
+    vec4 tangent(const int iface, const int nthvert) const; // per triangle corner tangent
     vec3 vert(const int i) const;
     vec3 vert(const int iface, const int nthvert) const;
+    vec2 uv(const int i) const;
     vec2 uv(const int iface, const int nthvert) const;
-    const TGAImage& diffuse()  const { return diffusemap;  }
-    const TGAImage& specular() const { return specularmap; }
+    const Texture& diffuse()  const { return diffusemap;  }
+    const Texture& specular() const { return specularmap; }
 };
 
+
+// streaming loader for the meshes too large to wait for: a background thread parses the obj file piece by piece and hands out
+// the faces as soon as they are parsed, in batches; a batch is a Model of its own (the deduplicated vertices and the tangent frames
+// of its faces, the textures of the file, no bvh nor levels of detail). At most `capacity` batches wait in the queue, the parser
+// stalls while it is full, and a batch is freed once drawn: the memory holds the vertex attributes of the file, a pool index per
+// position, and a few batches.
+// A face referring to vertices further down the file waits until they are parsed, the faces that never resolve are dropped.
+// The tangent frames are summed across the batches: a batch waits for a few more to be parsed before it is handed out, so that its
+// frames match those of a whole load unless the faces around a vertex lie further apart in the file; the sums are freed with the
+// last batch referring to them.
+// The cache is neither read nor written.
+class ModelStream {
+    struct Queue;
+    std::unique_ptr<Queue> queue;
+    std::array<Texture, 3> maps{}; // diffuse, normal and specular, loaded by the constructor while the parser runs
+    std::thread parser;
+    static void parse(const std::string filename, Queue &queue);
+public:
+    ModelStream(const std::string filename, const int capacity = 4);
+    ~ModelStream(); // stops and joins the parser, the remaining batches are discarded
+    ModelStream(const ModelStream&) = delete;
+    ModelStream& operator=(const ModelStream&) = delete;
+    std::optional<Model> next(); // blocks until the next batch is parsed, nullopt after the last one
+};
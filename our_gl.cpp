@@ -1,58 +1,556 @@
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <limits>
+#include <cmath>
 #include "our_gl.h"
+#include "profiler.h"
 
-mat<4,4> ModelView;
-mat<4,4> Viewport;
-mat<4,4> Projection;
+namespace {
+    // standard rotated sample patterns, offsets from the pixel center in 1/16 of a pixel
+    constexpr int pattern2[2][2] = {{4,4}, {-4,-4}};
+    constexpr int pattern4[4][2] = {{-2,-6}, {6,-2}, {-6,2}, {2,6}};
+    constexpr int pattern8[8][2] = {{1,-3}, {-1,3}, {5,1}, {-3,-5}, {-5,5}, {-7,-1}, {3,7}, {7,-7}};
+    const int (*sample_pattern(const int samples))[2] {
+        return samples==8 ? pattern8 : samples==4 ? pattern4 : pattern2;
+    }
+
+    Uniforms light_uniforms(const int size, const vec3 light_dir, const vec3 bbox_min, const vec3 bbox_max) {
+        const vec3 mid = (bbox_min+bbox_max)/2, l = vec3(light_dir).normalize();
+        const vec3 up = std::abs(l.y)<.99 ? vec3{0,1,0} : vec3{1,0,0};
+        const mat<4,4> ModelView = lookat(mid + l, mid, up);
+        double lo[2] = { std::numeric_limits<double>::max(),  std::numeric_limits<double>::max()};
+        double hi[2] = {-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
+        for (int c=0; c<8; c++) { // light space bounds of the corners of the bounding box
+            const vec3 corner = {c&1 ? bbox_max.x : bbox_min.x, c&2 ? bbox_max.y : bbox_min.y, c&4 ? bbox_max.z : bbox_min.z};
+            const vec4 v = ModelView*embed<4>(corner);
+            for (int i : {0,1}) { lo[i] = std::min<double>(lo[i], v[i]); hi[i] = std::max<double>(hi[i], v[i]); }
+        }
+        mat<4,4> Projection = mat<4,4>::identity(); // orthographic, maps the bounds to [-1,1] with a margin of one texel, keeps the depth
+        for (int i : {0,1}) {
+            const double margin = (hi[i]-lo[i])/size + 1e-6;
+            Projection[i][i] = 2/(hi[i]-lo[i]+2*margin);
+            Projection[i][3] = -(hi[i]+lo[i])/(hi[i]-lo[i]+2*margin);
+        }
+        return Uniforms(ModelView, Projection, viewport(0, 0, size, size));
+    }
+}
 
-void viewport(const int x, const int y, const int w, const int h) {
-    Viewport = {{{w/2., 0, 0, x+w/2.}, {0, h/2., 0, y+h/2.}, {0,0,1,0}, {0,0,0,1}}};
+mat<4,4> viewport(const int x, const int y, const int w, const int h) {
+    return {{{w/2.f, 0, 0, x+w/2.f}, {0, h/2.f, 0, y+h/2.f}, {0,0,1,0}, {0,0,0,1}}};
 }
 
-void projection(const double f) { // check https://en.wikipedia.org/wiki/Camera_matrix
-    Projection = {{{1,0,0,0}, {0,-1,0,0}, {0,0,1,0}, {0,0,-1/f,0}}}; // P[1,1] = -1; does vertical flip
+mat<4,4> projection(const float f) { // check https://en.wikipedia.org/wiki/Camera_matrix
+    return {{{1,0,0,0}, {0,-1,0,0}, {0,0,1,0}, {0,0,-1/f,0}}}; // P[1,1] = -1; does vertical flip
 }
 
-void lookat(const vec3 eye, const vec3 center, const vec3 up) { // check https://github.com/ssloy/tinyrenderer/wiki/Lesson-5-Moving-the-camera
+mat<4,4> lookat(const vec3 eye, const vec3 center, const vec3 up) { // check https://github.com/ssloy/tinyrenderer/wiki/Lesson-5-Moving-the-camera
     vec3 z = (center-eye).normalize();
     vec3 x =  cross(up,z).normalize();
     vec3 y =  cross(z, x).normalize();
     mat<4,4> Minv = {{{x.x,x.y,x.z,0},   {y.x,y.y,y.z,0},   {z.x,z.y,z.z,0},   {0,0,0,1}}};
     mat<4,4> Tr   = {{{1,0,0,-eye.x}, {0,1,0,-eye.y}, {0,0,1,-eye.z}, {0,0,0,1}}};
-    ModelView = Minv*Tr;
+    return Minv*Tr;
+}
+
+Uniforms::Uniforms(const mat<4,4> &ModelView, const mat<4,4> &Projection, const mat<4,4> &Viewport) :
+    ModelView(ModelView), Projection(Projection), Viewport(Viewport),
+    MVP(Projection*ModelView), NormalMatrix(ModelView.invert_transpose()) {}
+
+unsigned IShader::fragment_packet(const int iface, const FragmentPacket &packet, TGAColor colors[packet_size]) const {
+    unsigned mask = packet.mask;
+    for (int k=0; k<packet_size; k++)
+        if ((mask>>k & 1) && fragment(iface, {packet.bar[0][k], packet.bar[1][k], packet.bar[2][k]}, colors[k]))
+            mask &= ~(1u<<k);
+    return mask;
+}
+
+Rasterizer::Rasterizer(RenderTarget &target) : target(target), color(target.has_color()), width(target.width()), height(target.height()),
+    ntiles_x((width +tile_size-1)/tile_size),
+    ntiles_y((height+tile_size-1)/tile_size),
+    nblocks_x((width +hiz_block-1)/hiz_block),
+    nblocks_y((height+hiz_block-1)/hiz_block),
+    block_zmin(nblocks_x*nblocks_y), block_zmax(nblocks_x*nblocks_y),
+    bins(ntiles_x*ntiles_y) {}
+
+void Rasterizer::draw(IShader &shader, const int nverts, std::span<const int> indices, const Kernel kernels[4]) {
+    clip_verts.resize(nverts);
+#pragma omp parallel
+    {
+        PROFILE_SCOPE("vertex shading");
+#pragma omp for
+        for (int i=0; i<nverts; i++) // the vertex shader runs exactly once per vertex
+            shader.vertex(i, clip_verts[i]);
+    }
+    PROFILE_SCOPE("primitive assembly");
+    const int nfaces = indices.size()/3;
+    for (int i=0; i<nfaces; i++) {
+        const vec4 tri[3] = {clip_verts[indices[i*3]], clip_verts[indices[i*3+1]], clip_verts[indices[i*3+2]]};
+        triangle(tri, shader, i, kernels); // sort the triangle into the screen tiles
+    }
+    stats.vertices   += nverts;
+    stats.primitives += nfaces;
+}
+
+void Rasterizer::plane_distances(const vec4 &v, const Uniforms &uniforms, double dist[9]) const {
+    constexpr double guard_band = 1<<21; // pixels, keeps the 64-bit edge function arithmetic from overflowing
+    constexpr double near_w = 1e-5;      // the near plane, w is bounded away from zero before the perspective division
+    const mat<4,4> &V = uniforms.Viewport; // assumed to be axis-aligned: pixel = V[i][i]*ndc + V[i][3]
+    // the visible side of w depends on the projection: it is the sign of w for a point in front of the camera (view z = 1)
+    const double s = uniforms.Projection[3][2] + uniforms.Projection[3][3] < 0 ? -1 : 1;
+    const double x = s*v[0], y = s*v[1], w = s*v[3];
+    dist[0] = w - near_w;
+    for (int axis : {0,1}) {
+        const double c = axis ? y : x, scale = V[axis][axis], offset = V[axis][3];
+        const double lo[2] = {(-guard_band - offset)/scale, (0 - offset)/scale};
+        const double hi[2] = {( guard_band - offset)/scale, ((axis ? height : width) - offset)/scale};
+        for (int band : {0,1}) {
+            const double l = std::min(lo[band], hi[band]), h = std::max(lo[band], hi[band]); // a negative scale flips the axis
+            dist[1+band*4+axis*2] = c - l*w;
+            dist[2+band*4+axis*2] = h*w - c;
+        }
+    }
+}
+
+bool Rasterizer::visible(const vec3 bbox_min, const vec3 bbox_max, const Uniforms &uniforms) const {
+    double dist[8][9];
+    for (int c=0; c<8; c++) {
+        const vec3 corner = {c&1 ? bbox_max.x : bbox_min.x, c&2 ? bbox_max.y : bbox_min.y, c&4 ? bbox_max.z : bbox_min.z};
+        plane_distances(uniforms.MVP*embed<4>(corner), uniforms, dist[c]);
+    }
+    for (int p : {0,5,6,7,8}) { // same planes as the trivial reject of the triangles
+        bool outside = true;
+        for (int c=0; c<8; c++) outside &= dist[c][p]<0;
+        if (outside) return false;
+    }
+    return true;
 }
 
-vec3 barycentric(const vec2 tri[3], const vec2 P) {
-    mat<3,3> ABC = {{embed<3>(tri[0]), embed<3>(tri[1]), embed<3>(tri[2])}};
-    if (ABC.det()<1e-3) return {-1,1,1}; // for a degenerate triangle generate negative coordinates, it will be thrown away by the rasterizator
-    return ABC.invert_transpose() * embed<3>(P);
+void Rasterizer::draw(IShader &shader, const int nverts, std::span<const int> indices, std::span<const int> faces, const Kernel kernels[4]) {
+    clip_verts.resize(nverts);
+    used.assign(nverts, 0);
+    for (int f : faces)
+        for (int k : {0,1,2}) used[indices[f*3+k]] = 1;
+    int nused = 0;
+#pragma omp parallel reduction(+:nused)
+    {
+        PROFILE_SCOPE("vertex shading");
+#pragma omp for
+        for (int i=0; i<nverts; i++) // only the vertices of the faces drawn
+            if (used[i]) {
+                shader.vertex(i, clip_verts[i]);
+                nused++;
+            }
+    }
+    PROFILE_SCOPE("primitive assembly");
+    for (int f : faces) {
+        const vec4 tri[3] = {clip_verts[indices[f*3]], clip_verts[indices[f*3+1]], clip_verts[indices[f*3+2]]};
+        triangle(tri, shader, f, kernels);
+    }
+    stats.vertices   += nused;
+    stats.primitives += faces.size();
 }
 
-void triangle(const vec4 clip_verts[3], IShader &shader, TGAImage &image, std::vector<double> &zbuffer) {
-    vec4 pts[3]  = { Viewport*clip_verts[0],    Viewport*clip_verts[1],    Viewport*clip_verts[2]    };  // triangle screen coordinates before persp. division
-    vec2 pts2[3] = { proj<2>(pts[0]/pts[0][3]), proj<2>(pts[1]/pts[1][3]), proj<2>(pts[2]/pts[2][3]) };  // triangle screen coordinates after  perps. division
+void Rasterizer::triangle(const vec4 clip_verts[3], const IShader &shader, const int iface, const Kernel kernels[4]) {
+    const mat<4,4> &V = shader.uniforms.Viewport;
+    const double s = shader.uniforms.Projection[3][2] + shader.uniforms.Projection[3][3] < 0 ? -1 : 1;
 
-    vec2 bboxmin{ std::numeric_limits<double>::max(),  std::numeric_limits<double>::max()};
-    vec2 bboxmax{-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
-    vec2 clamp{image.width()-1, image.height()-1};
-    for (int i=0; i<3; i++)
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::max(0.,       std::min(bboxmin[j], pts2[i][j]));
-            bboxmax[j] = std::min(clamp[j], std::max(bboxmax[j], pts2[i][j]));
+    // signed distances to the clipping planes, in the homogeneous coordinates: the near plane, then
+    // left/right/bottom/top of the guard band (planes 1-4) and of the framebuffer (planes 5-8), non-negative means inside
+    double dist[3][9];
+    for (int i : {0,1,2})
+        plane_distances(clip_verts[i], shader.uniforms, dist[i]);
+    for (int p : {0,5,6,7,8}) // trivial reject: all the vertices lie outside of the same frustum plane
+        if (dist[0][p]<0 && dist[1][p]<0 && dist[2][p]<0) {
+            stats.culled_offscreen++;
+            return;
         }
-#pragma omp parallel for
-    for (int x=(int)bboxmin.x; x<=(int)bboxmax.x; x++) {
-        for (int y=(int)bboxmin.y; y<=(int)bboxmax.y; y++) {
-            vec3 bc_screen = barycentric(pts2, {(double)x, (double)y});
-            vec3 bc_clip   = {bc_screen.x/pts[0][3], bc_screen.y/pts[1][3], bc_screen.z/pts[2][3]};
-            bc_clip = bc_clip/(bc_clip.x+bc_clip.y+bc_clip.z); // check https://github.com/ssloy/tinyrenderer/wiki/Technical-difficulties-linear-interpolation-with-perspective-deformations
-            double frag_depth = vec3{clip_verts[0][2], clip_verts[1][2], clip_verts[2][2]}*bc_clip;
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0 || frag_depth > zbuffer[x+y*image.width()]) continue;
-            TGAColor color;
-            if (shader.fragment(bc_clip, color)) continue; // fragment shader can discard current fragment
-            zbuffer[x+y*image.width()] = frag_depth;
-            image.set(x, y, color);
+
+    // orientation of the projected triangle, valid even if it crosses w=0 (Olano & Greer, homogeneous rasterization)
+    const mat<3,3,double> M = {{{clip_verts[0][0], clip_verts[0][1], clip_verts[0][3]},
+                                {clip_verts[1][0], clip_verts[1][1], clip_verts[1][3]},
+                                {clip_verts[2][0], clip_verts[2][1], clip_verts[2][3]}}};
+    const double det = M.det()*s*V[0][0]*V[1][1];
+    if (det==0 || !std::isfinite(det)) {
+        stats.culled_degenerate++;
+        return;
+    }
+    const bool front = (det>0) == (front_face==Winding::CCW);
+    if ((cull==Cull::Back && !front) || (cull==Cull::Front && front)) {
+        stats.culled_backface++;
+        return;
+    }
+    const int orientation = det>0 ? 1 : -1;
+
+    const vec3 corners[3] = {{1,0,0}, {0,1,0}, {0,0,1}};
+    bool inside = true;
+    for (int i : {0,1,2})
+        for (int p=0; p<5; p++)
+            inside &= dist[i][p]>=0;
+    if (inside) {
+        setup(clip_verts, corners, false, orientation, shader, iface, kernels);
+        return;
+    }
+
+    // Sutherland-Hodgman against the near plane and the guard band, the vertices are interpolated in the clip space
+    // along with their barycentric coordinates w.r.t. the original triangle; each plane adds at most one vertex
+    struct Vertex { vec4 v; vec3 bar; double dist[5]; };
+    Vertex poly[8], tmp[8];
+    int n = 3;
+    for (int i : {0,1,2}) {
+        poly[i] = {clip_verts[i], corners[i], {}};
+        for (int p=0; p<5; p++) poly[i].dist[p] = dist[i][p];
+    }
+    for (int p=0; p<5 && n; p++) {
+        int m = 0;
+        for (int i=0; i<n; i++) {
+            const Vertex &a = poly[i], &b = poly[(i+1)%n];
+            if (a.dist[p]>=0) tmp[m++] = a;
+            if ((a.dist[p]>=0) != (b.dist[p]>=0)) {
+                // an edge shared by two triangles is walked in opposite directions, the intersection is always computed
+                // from the same endpoint so that both triangles get exactly the same vertex and no crack opens between them
+                const std::array<float, 4> ka = {a.v[0], a.v[1], a.v[2], a.v[3]}, kb = {b.v[0], b.v[1], b.v[2], b.v[3]};
+                const bool flip = kb<ka;
+                const Vertex &from = flip ? b : a, &to = flip ? a : b;
+                const double t = from.dist[p]/(from.dist[p]-to.dist[p]);
+                Vertex &c = tmp[m++];
+                c.v   = from.v   + (to.v  -from.v  )*float(t);
+                c.bar = from.bar + (to.bar-from.bar)*float(t);
+                for (int q=0; q<5; q++) c.dist[q] = from.dist[q] + (to.dist[q]-from.dist[q])*t;
+                c.dist[p] = 0; // exactly on the plane
+            }
         }
+        std::copy(tmp, tmp+m, poly);
+        n = m;
+    }
+    stats.clipped++;
+    for (int i=1; i+1<n; i++) { // triangle fan, the clipping preserves the orientation
+        const vec4 v[3]   = {poly[0].v,   poly[i].v,   poly[i+1].v};
+        const vec3 bar[3] = {poly[0].bar, poly[i].bar, poly[i+1].bar};
+        setup(v, bar, true, orientation, shader, iface, kernels);
     }
 }
 
+void Rasterizer::setup(const vec4 clip_verts_in[3], const vec3 bar_in[3], const bool clipped, const int orientation, const IShader &shader, const int iface, const Kernel kernels[4]) {
+    vec4 clip_verts[3] = {clip_verts_in[0], clip_verts_in[1], clip_verts_in[2]};
+    vec3 bar[3] = {bar_in[0], bar_in[1], bar_in[2]};
+    if (orientation<0) { // the edge functions expect a counterclockwise triangle
+        std::swap(clip_verts[1], clip_verts[2]);
+        std::swap(bar[1], bar[2]);
+    }
+    std::int64_t X[3], Y[3]; // fixed-point screen coordinates, inside of the guard band by now
+    for (int i : {0,1,2}) {
+        vec4 v = shader.uniforms.Viewport*clip_verts[i];
+        vec2 p = proj<2>(v/v[3]);
+        X[i] = std::llround(p.x*(1<<subpixel_bits));
+        Y[i] = std::llround(p.y*(1<<subpixel_bits));
+    }
+
+    Triangle t;
+    std::int64_t area = (X[1]-X[0])*(Y[2]-Y[0]) - (X[2]-X[0])*(Y[1]-Y[0]);
+    if (area<=0) { // zero area once snapped, or a sliver flipped by the snapping
+        stats.culled_degenerate++;
+        return;
+    }
+    for (int i : {0,1,2}) { // edge i is opposite to the vertex i, i.e. goes from the vertex i+1 to the vertex i+2
+        const int a = (i+1)%3, b = (i+2)%3;
+        const std::int64_t dx = X[b]-X[a], dy = Y[b]-Y[a];
+        const bool top_left = dy<0 || (dy==0 && dx>0); // top-left fill rule: pixels lying exactly on other edges belong to the neighbouring triangle
+        t.A[i] = -dy*(1<<subpixel_bits);
+        t.B[i] =  dx*(1<<subpixel_bits);
+        t.C[i] =  dy*X[a] - dx*Y[a] - !top_left;
+        t.inv_w[i]  = 1./clip_verts[i][3];
+        t.clip_z[i] = clip_verts[i][2];
+    }
+    // the interpolated depth is a convex combination of the vertex depths, up to the float rounding of the interpolation: the range is
+    // widened by a bound of that rounding, so that hi-z never rejects a fragment the depth test would pass (equal depth, later wins)
+    const float zslack = 16*std::numeric_limits<float>::epsilon()*std::max({std::abs(t.clip_z.x), std::abs(t.clip_z.y), std::abs(t.clip_z.z)});
+    t.zmin = std::min({t.clip_z.x, t.clip_z.y, t.clip_z.z}) - zslack;
+    t.zmax = std::max({t.clip_z.x, t.clip_z.y, t.clip_z.z}) + zslack;
+    t.inv_area = 1./area;
+    t.shader = &shader;
+    t.kernels = kernels;
+    t.iface  = iface;
+    t.clipped = clipped;
+    for (int i : {0,1,2})
+        for (int j : {0,1,2})
+            t.remap[i][j] = bar[j][i];
+
+    const std::int64_t one = 1<<subpixel_bits, reach = samples>1 && color ? one/2 : 0; // the samples lie within half a pixel of the centers
+    auto ceil_div = [one](const std::int64_t v) { return v>=0 ? (v+one-1)/one : -(-v/one); };
+    auto floor_div = [one](const std::int64_t v) { return v>=0 ? v/one : -((-v+one-1)/one); };
+    t.bbox[0] = std::max<std::int64_t>(ceil_div (std::min({X[0], X[1], X[2]}) - reach), 0);
+    t.bbox[1] = std::max<std::int64_t>(ceil_div (std::min({Y[0], Y[1], Y[2]}) - reach), 0);
+    t.bbox[2] = std::min<std::int64_t>(floor_div(std::max({X[0], X[1], X[2]}) + reach), width -1);
+    t.bbox[3] = std::min<std::int64_t>(floor_div(std::max({Y[0], Y[1], Y[2]}) + reach), height-1);
+    if (t.bbox[0]>t.bbox[2] || t.bbox[1]>t.bbox[3]) { // no pixel center is covered
+        stats.culled_offscreen++;
+        return;
+    }
+
+    int idx = tris.size();
+    tris.push_back(t);
+    stats.triangles++;
+    for (int ty=t.bbox[1]/tile_size; ty<=t.bbox[3]/tile_size; ty++)
+        for (int tx=t.bbox[0]/tile_size; tx<=t.bbox[2]/tile_size; tx++)
+            bins[tx+ty*ntiles_x].push_back(idx);
+}
+
+// the multisampled state of a tile lives only while the tile is rasterized: it is loaded from the render target,
+// and resolved back into them; most pixels are covered by a single triangle and keep one color for all their samples,
+// only the pixels along the edges are expanded to one color per sample, in a pool sized by the number of such pixels
+struct Rasterizer::SampleTile {
+    int x0, y0, n;                                // tile origin, samples per pixel
+    float z[tile_size*tile_size*max_samples];     // per-sample depths, pixel-major
+    std::uint32_t color[tile_size*tile_size];     // packed color of the pixels whose samples all agree
+    int expanded[tile_size*tile_size];            // offset of the per-sample colors of the pixel in pool, -1 if the samples agree
+    std::vector<std::uint32_t> pool;
+
+    void write(const int pixel, const unsigned samples, const std::uint32_t c) { // assign c to the samples of the pixel
+        if (samples==(1u<<n)-1) { // fully covered, the pixel is compressed again
+            color[pixel] = c;
+            expanded[pixel] = -1;
+            return;
+        }
+        if (expanded[pixel]<0) {
+            expanded[pixel] = pool.size();
+            pool.insert(pool.end(), n, color[pixel]);
+        }
+        for (int s=0; s<n; s++)
+            if (samples>>s & 1) pool[expanded[pixel]+s] = c;
+    }
+
+    std::uint32_t resolve(const int pixel) const { // box filter
+        if (expanded[pixel]<0) return color[pixel];
+        std::uint32_t c = 0;
+        for (int ch=0; ch<32; ch+=8) {
+            std::uint32_t sum = n/2;
+            for (int s=0; s<n; s++) sum += pool[expanded[pixel]+s]>>ch & 255;
+            c |= sum/n << ch;
+        }
+        return c;
+    }
+};
+
+void Rasterizer::update_block(const int bx, const int by, const SampleTile *ms) {
+    float zmin = std::numeric_limits<float>::max(), zmax = -std::numeric_limits<float>::max();
+    for (int y=by*hiz_block; y<std::min((by+1)*hiz_block, height); y++)
+        for (int x=bx*hiz_block; x<std::min((bx+1)*hiz_block, width); x++) {
+            if (!ms) {
+                zmin = std::min(zmin, target.depth_row(y)[x]);
+                zmax = std::max(zmax, target.depth_row(y)[x]);
+                continue;
+            }
+            const float *z = ms->z + ((x-ms->x0)+(y-ms->y0)*tile_size)*ms->n;
+            for (int s=0; s<ms->n; s++) {
+                zmin = std::min(zmin, z[s]);
+                zmax = std::max(zmax, z[s]);
+            }
+        }
+    block_zmin[bx+by*nblocks_x] = zmin;
+    block_zmax[bx+by*nblocks_x] = zmax;
+}
+
+unsigned Rasterizer::cover_samples(const Triangle &t, const int x, const int y, float depth[max_samples]) const {
+    const int (*pattern)[2] = sample_pattern(samples);
+    unsigned covered = 0;
+    for (int s=0; s<samples; s++) { // A and B are multiples of 16, the offsets are exact
+        std::int64_t w[3];
+        for (int i : {0,1,2}) w[i] = t.A[i]*x + t.B[i]*y + t.C[i] + t.A[i]/16*pattern[s][0] + t.B[i]/16*pattern[s][1];
+        covered |= unsigned((w[0]|w[1]|w[2])>=0) << s;
+        float bc[3];
+        for (int i : {0,1,2}) bc[i] = w[i]*(float)t.inv_area*(float)t.inv_w[i];
+        const float sum = bc[0]+bc[1]+bc[2];
+        depth[s] = ((float)t.clip_z[0]*bc[0] + (float)t.clip_z[1]*bc[1] + (float)t.clip_z[2]*bc[2])/sum;
+    }
+    return covered;
+}
+
+void Rasterizer::rasterize_tile(const int tile, RasterStats &stats) {
+    if (bins[tile].empty()) return;
+    PROFILE_SCOPE("rasterize tile");
+    const int x0 = (tile%ntiles_x)*tile_size, x1 = std::min(x0+tile_size, width)-1;
+    const int y0 = (tile/ntiles_x)*tile_size, y1 = std::min(y0+tile_size, height)-1;
+    const int bx0 = x0/hiz_block, bx1 = x1/hiz_block, by0 = y0/hiz_block, by1 = y1/hiz_block;
+    const bool multisample = color && samples>1;
+    const bool deferred_shading = deferred && !multisample && !discards;
+    const bool shade = color && !deferred_shading; // shade the fragments as soon as they pass the depth test
+    int visibility[tile_size*tile_size]; // deferred mode: index in tris of the visible triangle of every pixel of the tile, -1 if none
+    if (color && deferred_shading) std::fill(visibility, visibility+tile_size*tile_size, -1);
+    thread_local SampleTile tile_samples; // too large for the stack, reused by all the tiles of the thread
+    SampleTile *ms = multisample ? &tile_samples : nullptr;
+    if (ms) {
+        ms->x0 = x0;
+        ms->y0 = y0;
+        ms->n = samples;
+        ms->pool.clear();
+        for (int y=y0; y<=y1; y++)
+            for (int x=x0; x<=x1; x++) {
+                const int p = (x-x0)+(y-y0)*tile_size;
+                std::fill(ms->z + p*samples, ms->z + (p+1)*samples, target.depth_row(y)[x]);
+                ms->color[p] = target.color_row(y)[x];
+                ms->expanded[p] = -1;
+            }
+    }
+
+    // the depth buffer may have been modified outside of the rasterizer, refresh the depth bounds of the tile
+    float tile_zmax = -std::numeric_limits<float>::max();
+    for (int by=by0; by<=by1; by++)
+        for (int bx=bx0; bx<=bx1; bx++) {
+            update_block(bx, by, ms);
+            tile_zmax = std::max(tile_zmax, block_zmax[bx+by*nblocks_x]);
+        }
+
+    for (int idx : bins[tile]) {
+        const Triangle &t = tris[idx];
+        const int xmin = std::max(x0, t.bbox[0]), xmax = std::min(x1, t.bbox[2]);
+        const int ymin = std::max(y0, t.bbox[1]), ymax = std::min(y1, t.bbox[3]);
+        if (t.zmin>tile_zmax) { // the triangle lies behind everything drawn in the tile
+            stats.hiz_rejects++;
+            stats.pixels_skipped += (xmax-xmin+1)*(ymax-ymin+1);
+            continue;
+        }
+        bool tile_written = false;
+        for (int by=ymin/hiz_block; by<=ymax/hiz_block; by++) {
+            for (int bx=xmin/hiz_block; bx<=xmax/hiz_block; bx++) {
+                const int bxmin = std::max(xmin, bx*hiz_block), bxmax = std::min(xmax, bx*hiz_block+hiz_block-1);
+                const int bymin = std::max(ymin, by*hiz_block), bymax = std::min(ymax, by*hiz_block+hiz_block-1);
+                if (t.zmin>block_zmax[bx+by*nblocks_x]) {
+                    stats.hiz_rejects++;
+                    stats.pixels_skipped += (bxmax-bxmin+1)*(bymax-bymin+1);
+                    continue;
+                }
+                const bool depth_test = t.zmax>=block_zmin[bx+by*nblocks_x]; // otherwise the triangle is in front of the whole block
+                bool block_written = true; // conservatively in the multisampled case, the coverage is not known here
+                if (ms) {
+                    for (int y=bymin&~1; y<=bymax; y+=2)
+                        for (int x=bxmin - bxmin%packet_w; x<=bxmax; x+=packet_w)
+                            stats.fragments_shaded += multisample_packet(t, x, y, bxmin, bxmax, bymin, bymax, *ms, stats);
+                } else
+                    block_written = (this->*t.kernels[2*shade + depth_test])(t, idx, bxmin, bxmax, bymin, bymax, visibility, x0, y0, stats);
+                if (block_written) update_block(bx, by, ms);
+                tile_written |= block_written;
+            }
+        }
+        if (!tile_written) continue;
+        tile_zmax = -std::numeric_limits<float>::max();
+        for (int by=by0; by<=by1; by++)
+            for (int bx=bx0; bx<=bx1; bx++)
+                tile_zmax = std::max(tile_zmax, block_zmax[bx+by*nblocks_x]);
+    }
+    if (color && deferred_shading) shade_tile(x0, y0, x1, y1, visibility, stats);
+    if (!ms) return;
+    for (int y=y0; y<=y1; y++) // resolve
+        for (int x=x0; x<=x1; x++) {
+            const int p = (x-x0)+(y-y0)*tile_size;
+            target.color_row(y)[x] = ms->resolve(p);
+            target.depth_row(y)[x] = *std::min_element(ms->z + p*samples, ms->z + (p+1)*samples);
+        }
+}
+
+int Rasterizer::multisample_packet(const Triangle &t, const int x, const int y, const int xmin, const int xmax, const int ymin, const int ymax, SampleTile &ms, RasterStats &stats) {
+    FragmentPacket packet;
+    float center_depth[packet_size];
+    float depth[packet_size][max_samples];
+    unsigned passed[packet_size]; // per-pixel masks of the samples that are covered and pass the depth test
+    {
+        PROFILE_ACCUMULATE("coverage, barycentrics and depth test");
+        interpolate(t, x, y, packet, center_depth); // the shading happens at the pixel center, even if it is not covered
+        packet.mask = 0;
+        for (int k=0; k<packet_size; k++) {
+            const int px = x + k%packet_w, py = y + k/packet_w;
+            passed[k] = 0;
+            if (px<xmin || px>xmax || py<ymin || py>ymax) continue; // the pixel belongs to another block
+            const unsigned covered = cover_samples(t, px, py, depth[k]);
+            if (!covered) continue;
+            const float *z = ms.z + ((px-ms.x0)+(py-ms.y0)*tile_size)*ms.n;
+            for (int s=0; s<ms.n; s++)
+                passed[k] |= unsigned((covered>>s & 1) && depth[k][s]<=z[s]) << s;
+            stats.fragments++;
+            stats.fragments_culled += !passed[k];
+            packet.mask |= unsigned(passed[k]!=0) << k;
+        }
+    }
+    if (!packet.mask) return 0;
+    TGAColor colors[packet_size];
+    unsigned mask;
+    {
+        PROFILE_ACCUMULATE("fragment shading");
+        mask = t.shader->fragment_packet(t.iface, packet, colors); // once per pixel, whatever the number of samples covered
+    }
+    for (int k=0; k<packet_size; k++) {
+        if (!(mask>>k & 1)) continue;
+        const int p = (x+k%packet_w-ms.x0)+(y+k/packet_w-ms.y0)*tile_size;
+        for (int s=0; s<ms.n; s++)
+            if (passed[k]>>s & 1) ms.z[p*ms.n+s] = depth[k][s];
+        ms.write(p, passed[k], RenderTarget::pack(colors[k]));
+    }
+    return std::popcount(packet.mask);
+}
+
+void Rasterizer::shade_tile(const int x0, const int y0, const int x1, const int y1, const int visibility[], RasterStats &stats) {
+    PROFILE_ACCUMULATE("fragment shading");
+    for (int y=y0; y<=y1; y+=2) // the tile origin is aligned to the packets
+        for (int x=x0; x<=x1; x+=packet_w) {
+            int ids[packet_size]; // visible triangle of every lane
+            for (int k=0; k<packet_size; k++) {
+                const int px = x + k%packet_w, py = y + k/packet_w;
+                ids[k] = px<=x1 && py<=y1 ? visibility[(px-x0)+(py-y0)*tile_size] : -1;
+            }
+            unsigned todo = 0;
+            for (int k=0; k<packet_size; k++) todo |= unsigned(ids[k]>=0) << k;
+            while (todo) { // one packet per distinct triangle of the quads, the other lanes are helpers for the derivatives
+                const int idx = ids[std::countr_zero(todo)];
+                const Triangle &t = tris[idx];
+                FragmentPacket packet;
+                float depth[packet_size];
+                interpolate(t, x, y, packet, depth);
+                packet.mask = 0;
+                for (int k=0; k<packet_size; k++) packet.mask |= unsigned(ids[k]==idx) << k;
+                todo &= ~packet.mask;
+                stats.fragments_shaded += std::popcount(packet.mask);
+                TGAColor colors[packet_size];
+                const unsigned mask = t.shader->fragment_packet(t.iface, packet, colors); // discarding is not supported here, the depth is already written
+                for (int k=0; k<packet_size; k++)
+                    if (mask>>k & 1) target.color_row(y+k/packet_w)[x+k%packet_w] = RenderTarget::pack(colors[k]);
+            }
+        }
+}
+
+void Rasterizer::flush() {
+    // a tile is owned by exactly one thread, thus the depth test and the write are race-free,
+    // and the triangles of a tile are drawn in the submission order
+#pragma omp parallel
+    {
+        RasterStats local{};
+#pragma omp for schedule(dynamic, 1)
+        for (int tile=0; tile<ntiles_x*ntiles_y; tile++)
+            rasterize_tile(tile, local);
+#pragma omp critical
+        stats += local;
+    }
+    tris.clear();
+    for (std::vector<int> &bin : bins) bin.clear();
+    discards = false;
+}
+
+ShadowMap::ShadowMap(const int size, const vec3 light_dir, const vec3 bbox_min, const vec3 bbox_max) : size(size),
+    uniforms(light_uniforms(size, light_dir, bbox_min, bbox_max)),
+    target(size, size, false),
+    bias(2/uniforms.Viewport[0][0]/uniforms.Projection[0][0]) {}
+
+vec3 ShadowMap::project(const vec3 p) const {
+    const vec4 v = uniforms.Viewport*uniforms.MVP*embed<4>(p);
+    return proj<3>(v/v[3]);
+}
+
+float ShadowMap::lit(const vec3 q) const {
+    const int x = std::lround(q.x), y = std::lround(q.y); // the rasterizer samples the texels at integer coordinates
+    int visible = 0;
+    for (int j=y-pcf; j<=y+pcf; j++)
+        for (int i=x-pcf; i<=x+pcf; i++) { // a sloped receiver lies deeper at the farther texels, the offset grows with the distance
+            const double z = q.z - bias*(1 + std::abs(i-q.x) + std::abs(j-q.y));
+            visible += i<0 || j<0 || i>=size || j>=size || z<=target.depth_row(j)[i]; // the scene lies inside of the map, outside is lit
+        }
+    return visible/float((2*pcf+1)*(2*pcf+1));
+}
@@ -1,16 +1,280 @@
+#include <bit>
+#include <span>
+#include <type_traits>
 #include "tgaimage.h"
+#include "rendertarget.h"
 #include "geometry.h"
+#include "profiler.h"
 
-void viewport(const int x, const int y, const int w, const int h);
-void projection(const double coeff=0); // coeff = -1/c
-void lookat(const vec3 eye, const vec3 center, const vec3 up);
+mat<4,4> viewport(const int x, const int y, const int w, const int h);
+mat<4,4> projection(const float coeff=0); // coeff = -1/c
+mat<4,4> lookat(const vec3 eye, const vec3 center, const vec3 up);
+
+struct Uniforms { // per-draw "OpenGL" state, the derived matrices are computed once here instead of per vertex
+    mat<4,4> ModelView, Projection, Viewport;
+    mat<4,4> MVP;          // Projection*ModelView
+    mat<4,4> NormalMatrix; // inverse transpose of ModelView, transforms the normal vectors
+    Uniforms(const mat<4,4> &ModelView, const mat<4,4> &Projection, const mat<4,4> &Viewport);
+};
+
+#ifdef __AVX2__
+constexpr int packet_size = 8; // fragments are shaded in packets of 2x2 pixel quads, one pixel per SIMD float lane
+#else
+constexpr int packet_size = 4;
+#endif
+constexpr int packet_w = packet_size/2; // a packet covers packet_w x 2 pixels
+
+struct FragmentPacket {
+    alignas(32) float bar[3][packet_size]; // perspective-corrected barycentric coordinates, structure of arrays
+    int x, y;                              // screen coordinates of the top left pixel of the packet, both are even
+    unsigned mask;                         // bit k is set iff the pixel (x + k%packet_w, y + k/packet_w) is covered and has passed the depth test
+};
+
+// screen-space derivatives of a per-lane value, finite differences within each 2x2 quad;
+// the lanes outside of the triangle are still interpolated, so the differences are valid for all the lanes
+inline void quad_derivatives(const float v[packet_size], float ddx[packet_size], float ddy[packet_size]) {
+    for (int k=0; k<packet_size; k++) {
+        ddx[k] = v[k|1] - v[k&~1];
+        ddy[k] = v[k%packet_w + packet_w] - v[k%packet_w];
+    }
+}
 
 struct IShader {
-    static TGAColor sample2D(const TGAImage &img, vec2 &uvf) {
-        return img.get(uvf[0] * img.width(), uvf[1] * img.height());
+    // compile-time properties read by the rasterizer kernels specialized for the shader type (see Rasterizer::draw),
+    // a derived shader redeclares them to enable the corresponding shortcuts
+    static constexpr bool discards = true; // false: the fragment shader never discards, its returned mask is ignored
+
+    const Uniforms &uniforms;
+    IShader(const Uniforms &uniforms) : uniforms(uniforms) {}
+    virtual void vertex(const int ivert, vec4 &gl_Position) = 0; // called once per vertex by the draw call, concurrently
+    virtual bool fragment(const int iface, const vec3 bar, TGAColor &color) const = 0; // called concurrently from several threads, must not modify the shader
+    // batched entry point: shades the pixels of packet.mask and returns the mask of the non-discarded ones,
+    // the default implementation falls back to the per-pixel fragment()
+    virtual unsigned fragment_packet(const int iface, const FragmentPacket &packet, TGAColor colors[packet_size]) const;
+};
+
+constexpr int tile_size = 32; // the screen is split into tile_size x tile_size tiles, each tile is rasterized by a single thread
+
+constexpr int max_samples = 8; // multisample anti-aliasing: coverage and depth at up to 8 positions per pixel
+constexpr int hiz_block = 8;     // every tile is further split into hiz_block x hiz_block blocks with conservative depth bounds
+constexpr int subpixel_bits = 8; // vertex screen coordinates are snapped to 1/256 of a pixel
+
+struct RasterStats {
+    std::uint64_t vertices         = 0; // vertex shader invocations
+    std::uint64_t primitives       = 0; // triangles submitted by the draw calls
+    std::uint64_t culled_frustum   = 0; // triangles never submitted, their whole cluster lies outside of the view frustum
+    std::uint64_t culled_lod       = 0; // triangles of the full models never submitted, a coarser level of detail is drawn instead
+    std::uint64_t culled_offscreen = 0; // triangles (or clipped pieces) entirely outside of the screen or behind the camera
+    std::uint64_t culled_backface  = 0; // triangles facing away according to Rasterizer::cull
+    std::uint64_t culled_degenerate = 0; // zero-area triangles (or clipped pieces), before or after snapping to the subpixel grid
+    std::uint64_t clipped          = 0; // triangles crossing the near plane or the guard band, split into pieces
+    std::uint64_t triangles        = 0; // triangles (or clipped pieces) binned
+    std::uint64_t hiz_rejects      = 0; // triangle/tile and triangle/block pairs rejected by the hierarchical depth test
+    std::uint64_t pixels_skipped   = 0; // bounding box pixels never visited thanks to these rejects
+    std::uint64_t fragments        = 0; // covered pixels that reached the per-pixel depth test
+    std::uint64_t fragments_culled = 0; // covered pixels that failed the per-pixel depth test
+    std::uint64_t fragments_shaded = 0; // fragments passed to the fragment shader, their ratio to the covered pixels is the overdraw
+    RasterStats& operator+=(const RasterStats &rhs) {
+        vertices += rhs.vertices; primitives += rhs.primitives; culled_frustum += rhs.culled_frustum; culled_lod += rhs.culled_lod;
+        culled_offscreen += rhs.culled_offscreen; culled_backface += rhs.culled_backface; culled_degenerate += rhs.culled_degenerate;
+        clipped += rhs.clipped; triangles += rhs.triangles; hiz_rejects += rhs.hiz_rejects; pixels_skipped += rhs.pixels_skipped;
+        fragments += rhs.fragments; fragments_culled += rhs.fragments_culled; fragments_shaded += rhs.fragments_shaded;
+        return *this;
     }
-    virtual bool fragment(const vec3 bar, TGAColor &color) = 0;
 };
 
-void triangle(const vec4 clip_verts[3], IShader &shader, TGAImage &image, std::vector<double> &zbuffer);
+enum class Cull { None, Back, Front };
+enum class Winding { CCW, CW }; // in the pixel coordinates of the framebuffer
 
+class Rasterizer {
+    struct Triangle;
+    // rasterizes the part of a triangle within a hiz block: coverage, depth test and shading of the packets, writes the target;
+    // returns true if a pixel was written, see raster_block()
+    using Kernel = bool (Rasterizer::*)(const Triangle &t, const int idx, const int xmin, const int xmax, const int ymin, const int ymax,
+                                        int visibility[], const int x0, const int y0, RasterStats &stats);
+    struct Triangle {
+        std::int64_t A[3], B[3], C[3]; // edge functions w_i(x,y) = A_i*x + B_i*y + C_i, evaluated at pixel (x,y), fill rule bias is in C_i
+        double inv_area;                // 1/(w_0+w_1+w_2), turns the edge functions into screen barycentric coordinates
+        vec3 inv_w;                     // 1/w of the vertices for the perspective correction
+        vec3 clip_z;                    // clip z coordinates of the vertices, interpolated for the depth test
+        float zmin, zmax;               // depth range of the triangle, conservative for the rounding of the interpolated depth
+        int bbox[4];                    // clamped screen bounding box xmin, ymin, xmax, ymax
+        const IShader *shader;
+        const Kernel *kernels;          // the kernels specialized for the type of the shader, see kernels<S>
+        int iface;                      // face index passed back to the fragment shader
+        bool clipped;                   // the triangle is a piece of a clipped primitive, its barycentric coordinates are remapped
+        float remap[3][3];              // column j holds the barycentric coordinates of the vertex j w.r.t. the original primitive
+    };
+    RenderTarget &target;
+    bool color;                          // false for a depth-only target
+    int width, height;
+    int ntiles_x, ntiles_y;
+    int nblocks_x, nblocks_y;
+    std::vector<float> block_zmin, block_zmax; // per-block bounds of the depth buffer, the hierarchical depth buffer
+    std::vector<Triangle> tris;          // all triangles submitted since the last flush, in submission order
+    std::vector<std::vector<int>> bins;  // per-tile lists of indices in the tris array, in submission order
+    bool discards = false;               // a shader of the binned triangles may discard fragments, see deferred
+    std::vector<vec4> clip_verts;        // post-transform vertex buffer of the current draw call
+    std::vector<std::uint8_t> used;      // vertices referenced by the faces of the current draw call
+    struct SampleTile;                   // per-sample depth and colors of the tile being rasterized with samples>1
+    // S is the static type of the shader, its fragment_packet() is called directly and inlined into the packet loop;
+    // depth_test is false for a triangle in front of the whole block, shade is false in the depth-only and deferred passes
+    template <class S, bool depth_test, bool shade>
+    bool raster_block(const Triangle &t, const int idx, const int xmin, const int xmax, const int ymin, const int ymax,
+                      int visibility[], const int x0, const int y0, RasterStats &stats);
+    // indexed by 2*shade + depth_test, the passes without shading do not depend on the shader type and share a single instance
+    template <class S> static constexpr Kernel kernels[4] = {
+        &Rasterizer::raster_block<IShader, false, false>, &Rasterizer::raster_block<IShader, true, false>,
+        &Rasterizer::raster_block<S, false, true>,        &Rasterizer::raster_block<S, true, true>
+    };
+    void draw(IShader &shader, const int nverts, std::span<const int> indices, const Kernel kernels[4]);
+    void draw(IShader &shader, const int nverts, std::span<const int> indices, std::span<const int> faces, const Kernel kernels[4]);
+    void triangle(const vec4 clip_verts[3], const IShader &shader, const int iface, const Kernel kernels[4]);
+    void plane_distances(const vec4 &v, const Uniforms &uniforms, double dist[9]) const; // see triangle()
+    void setup(const vec4 clip_verts[3], const vec3 bar[3], const bool clipped, const int orientation, const IShader &shader, const int iface, const Kernel kernels[4]);
+    void update_block(const int bx, const int by, const SampleTile *ms = nullptr); // the bounds are taken over the samples of ms if given
+    // perspective-corrected barycentric coordinates and depth of the packet at (x,y), returns the mask of the lanes covered by t
+    unsigned interpolate(const Triangle &t, const int x, const int y, FragmentPacket &packet, float depth[packet_size]) const;
+    // coverage mask and depths of the samples of the pixel (x,y)
+    unsigned cover_samples(const Triangle &t, const int x, const int y, float depth[max_samples]) const;
+    void rasterize_tile(const int tile, RasterStats &stats);
+    // multisampled counterpart of the packet loop body: tests the samples of the packet pixels within the block bounds,
+    // shades the pixels with at least one visible sample and writes the samples to ms; returns the number of pixels shaded
+    int multisample_packet(const Triangle &t, const int x, const int y, const int xmin, const int xmax, const int ymin, const int ymax, SampleTile &ms, RasterStats &stats);
+    void shade_tile(const int x0, const int y0, const int x1, const int y1, const int visibility[], RasterStats &stats);
+public:
+    RasterStats stats{};
+    Cull cull = Cull::Back;              // which faces are dropped before the rasterization
+    Winding front_face = Winding::CCW;   // orientation of the front faces
+    // deferred shading: the tiles are rasterized into a visibility buffer (depth and triangle per pixel) first,
+    // then every visible pixel is shaded exactly once, whatever the overdraw; a flush with a shader that may discard
+    // (S::discards, or any shader drawn as an IShader&) is shaded forward instead, since its visible pixels are only known once shaded
+    bool deferred = false;
+    // MSAA: 1 (off), 2, 4 or 8 samples per pixel; the fragment shader still runs once per pixel and triangle, at the pixel center,
+    // the samples are resolved into the target at the end of every tile, its depth is the nearest sample; deferred is ignored.
+    // Every flush resolves the tiles, and the next one starts from the resolved pixels: a multisampled frame takes a single flush
+    int samples = 1;
+    // a target without a color buffer makes a depth-only rasterizer: same setup and depth test, but the fragment shader is never called
+    Rasterizer(RenderTarget &target);
+    // draw call: runs the vertex shader once per vertex, assembles the triangles from the index buffer and bins them;
+    // the triangles are rasterized by a packet loop compiled for the shader type S, with S::fragment_packet inlined (S must be final),
+    // an IShader& (e.g. a shader loaded from a plugin) is the type-erased entry point: one virtual call per packet
+    template <class S> void draw(S &shader, const int nverts, std::span<const int> indices) {
+        discards |= S::discards;
+        draw(shader, nverts, indices, kernels<S>);
+    }
+    // same for a subset of the faces, the vertex shader only runs for the vertices they use
+    template <class S> void draw(S &shader, const int nverts, std::span<const int> indices, std::span<const int> faces) {
+        discards |= S::discards;
+        draw(shader, nverts, indices, faces, kernels<S>);
+    }
+    // false if the box (in the model space of the uniforms) lies entirely outside of the view frustum, conservative
+    bool visible(const vec3 bbox_min, const vec3 bbox_max, const Uniforms &uniforms) const;
+    // primitive assembly: culls, clips against the near plane and the guard band, and bins the resulting pieces; no pixel is touched
+    template <class S> void triangle(const vec4 clip_verts[3], const S &shader, const int iface) {
+        discards |= S::discards;
+        triangle(clip_verts, shader, iface, kernels<S>);
+    }
+    void flush(); // rasterize all binned triangles, tiles are processed in parallel
+};
+
+inline unsigned Rasterizer::interpolate(const Triangle &t, const int x, const int y, FragmentPacket &packet, float depth[packet_size]) const {
+    const float inv_area = t.inv_area;
+    bool inside[packet_size];
+#pragma omp simd
+    for (int k=0; k<packet_size; k++) { // coverage is tested on the exact integer edge functions, the rest in float lanes
+        const int px = x + k%packet_w, py = y + k/packet_w;
+        std::int64_t w[3];
+        for (int i : {0,1,2}) w[i] = t.A[i]*px + t.B[i]*py + t.C[i];
+        inside[k] = (w[0]|w[1]|w[2])>=0;
+        float bc[3];
+        for (int i : {0,1,2}) bc[i] = w[i]*inv_area*(float)t.inv_w[i];
+        float sum = bc[0]+bc[1]+bc[2]; // check https://github.com/ssloy/tinyrenderer/wiki/Technical-difficulties-linear-interpolation-with-perspective-deformations
+        for (int i : {0,1,2}) packet.bar[i][k] = bc[i]/sum;
+        depth[k] = (float)t.clip_z[0]*packet.bar[0][k] + (float)t.clip_z[1]*packet.bar[1][k] + (float)t.clip_z[2]*packet.bar[2][k];
+    }
+    if (t.clipped && color) { // the depth-only path needs no barycentric coordinates w.r.t. the original primitive
+#pragma omp simd
+        for (int k=0; k<packet_size; k++) { // barycentric coordinates w.r.t. the original primitive for the shader
+            const float b[3] = {packet.bar[0][k], packet.bar[1][k], packet.bar[2][k]};
+            for (int i : {0,1,2}) packet.bar[i][k] = t.remap[i][0]*b[0] + t.remap[i][1]*b[1] + t.remap[i][2]*b[2];
+        }
+    }
+    packet.x = x;
+    packet.y = y;
+    unsigned covered = 0;
+    for (int k=0; k<packet_size; k++)
+        covered |= unsigned(inside[k]) << k;
+    return covered;
+}
+
+template <class S, bool depth_test, bool shade>
+bool Rasterizer::raster_block(const Triangle &t, const int idx, const int xmin, const int xmax, const int ymin, const int ymax,
+                              int visibility[], const int x0, const int y0, RasterStats &stats) {
+    // the call below is bound to S::fragment_packet, an override in a class derived from S would be silently skipped
+    static_assert(std::is_same_v<S, IShader> || std::is_final_v<S>, "a shader drawn through its static type must be final, or be passed as IShader&");
+    bool written = false;
+    for (int y=ymin&~1; y<=ymax; y+=2) { // the packets are aligned to even coordinates, the block origin is aligned as well
+        float *zrow[2] = {target.depth_row(y), target.depth_row(y+1)};
+        for (int x=xmin - xmin%packet_w; x<=xmax; x+=packet_w) {
+            FragmentPacket packet;
+            float depth[packet_size];
+            unsigned covered;
+            {
+                PROFILE_ACCUMULATE("coverage, barycentrics and depth test");
+                covered = interpolate(t, x, y, packet, depth);
+                packet.mask = 0;
+                for (int k=0; k<packet_size; k++) {
+                    const int px = x + k%packet_w, py = y + k/packet_w;
+                    if (px<xmin || px>xmax || py<ymin || py>ymax) covered &= ~(1u<<k); // the pixel belongs to another block
+                    packet.mask |= unsigned((covered>>k & 1) && (!depth_test || depth[k]<=zrow[k/packet_w][px])) << k;
+                }
+            }
+            stats.fragments        += std::popcount(covered);
+            stats.fragments_culled += std::popcount(covered & ~packet.mask);
+            if (!packet.mask) continue;
+            if constexpr (!shade) { // depth-only, or deferred: only the visibility is resolved now, the shading is done once per pixel later
+                for (int k=0; k<packet_size; k++) {
+                    if (!(packet.mask>>k & 1)) continue;
+                    const int px = x + k%packet_w, py = y + k/packet_w;
+                    zrow[k/packet_w][px] = depth[k];
+                    if (color) visibility[(px-x0)+(py-y0)*tile_size] = idx;
+                }
+                written = true;
+            } else {
+                stats.fragments_shaded += std::popcount(packet.mask);
+                TGAColor colors[packet_size];
+                unsigned mask;
+                {
+                    PROFILE_ACCUMULATE("fragment shading");
+                    const S &shader = static_cast<const S &>(*t.shader);
+                    if constexpr (std::is_same_v<S, IShader>)
+                        mask = shader.fragment_packet(t.iface, packet, colors); // virtual call
+                    else
+                        mask = shader.S::fragment_packet(t.iface, packet, colors); // statically bound, inlined
+                }
+                if constexpr (!S::discards) mask = packet.mask;
+                std::uint32_t *crow[2] = {target.color_row(y), target.color_row(y+1)};
+                for (int k=0; k<packet_size; k++) {
+                    if (!(mask>>k & 1)) continue;
+                    zrow[k/packet_w][x+k%packet_w] = depth[k];
+                    crow[k/packet_w][x+k%packet_w] = RenderTarget::pack(colors[k]);
+                }
+                written |= mask!=0;
+            }
+        }
+    }
+    return written;
+}
+
+// depth of the scene as seen from a directional light, rendered by a depth-only Rasterizer with an orthographic projection
+struct ShadowMap {
+    int size;                  // the map is size x size texels
+    Uniforms uniforms;         // light view, orthographic projection fitted to the scene bounding box, viewport of the map
+    RenderTarget target;       // depth only, in the units of the scene
+    double bias;               // depth offset against self-shadowing per texel of distance, two texel widths by default (slopes up to 63 degrees)
+    int pcf = 1;               // radius of the percentage-closer filter, 0 for hard shadows
+    ShadowMap(const int size, const vec3 light_dir, const vec3 bbox_min, const vec3 bbox_max);
+    vec3 project(const vec3 p) const; // texel coordinates and depth of a point of the scene, to be interpolated as a varying
+    float lit(const vec3 q) const;    // fraction of the (2*pcf+1)^2 texels around the projected point q that see the light
+};
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "profiler.h"
+
+namespace {
+    struct Event { const char *name; std::int64_t begin, end; };
+    struct Total { std::int64_t ns = 0, calls = 0; };
+
+    struct ThreadLog { // written by its thread only, read once all the work is done
+        int tid;
+        std::vector<Event> events;
+        std::vector<std::pair<const char *, Total>> totals; // few stages, looked up by the address of the literal
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> logs; // never freed, the logs outlive their threads
+    std::vector<std::pair<const char *, double>> counters;
+    std::vector<std::int64_t> counter_times;
+
+    ThreadLog &thread_log() {
+        thread_local ThreadLog *log = [] {
+            std::lock_guard<std::mutex> lock(mutex);
+            logs.push_back(std::make_unique<ThreadLog>());
+            logs.back()->tid = logs.size()-1;
+            return logs.back().get();
+        }();
+        return *log;
+    }
+
+    std::string escape(const std::string &s) {
+        std::string ret;
+        for (char c : s) {
+            if (c=='"' || c=='\\') ret += '\\';
+            ret += c;
+        }
+        return ret;
+    }
+}
+
+std::int64_t profiler::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+}
+
+void profiler::record(const char *name, const std::int64_t begin, const std::int64_t end, const bool trace) {
+    ThreadLog &log = thread_log();
+    if (trace) log.events.push_back({name, begin, end});
+    auto it = std::find_if(log.totals.begin(), log.totals.end(), [name](const auto &t) { return t.first==name; });
+    if (it==log.totals.end()) {
+        log.totals.push_back({name, {}});
+        it = log.totals.end()-1;
+    }
+    it->second.ns += end-begin;
+    it->second.calls++;
+}
+
+void profiler::counter(const char *name, const double value) {
+    const std::int64_t t = now();
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.push_back({name, value});
+    counter_times.push_back(t);
+}
+
+void profiler::summary(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, std::map<int, Total>> stages; // stage name -> thread -> total
+    for (const auto &log : logs)
+        for (const auto &[name, total] : log->totals)
+            stages[name][log->tid] = total;
+    out << "# profile: stage, total ms, calls, per thread ms" << std::endl;
+    for (const auto &[name, threads] : stages) {
+        Total sum;
+        for (const auto &[tid, t] : threads) { sum.ns += t.ns; sum.calls += t.calls; }
+        out << "#   " << name << " " << sum.ns*1e-6 << " ms " << sum.calls << " calls |";
+        for (const auto &[tid, t] : threads)
+            out << " t" << tid << ":" << t.ns*1e-6;
+        out << std::endl;
+    }
+    for (const auto &[name, value] : counters)
+        out << "#   " << name << " = " << value << std::endl;
+}
+
+bool profiler::write_trace(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    auto sep = [&]() -> std::ostream& { out << (first ? "" : ",\n"); first = false; return out; };
+    for (const auto &log : logs) {
+        sep() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << log->tid << ",\"args\":{\"name\":\"thread " << log->tid << "\"}}";
+        for (const Event &e : log->events) // complete events, in microseconds
+            sep() << "{\"name\":\"" << escape(e.name) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << log->tid
+                  << ",\"ts\":" << e.begin*1e-3 << ",\"dur\":" << (e.end-e.begin)*1e-3 << "}";
+    }
+    for (size_t i=0; i<counters.size(); i++)
+        sep() << "{\"name\":\"" << escape(counters[i].first) << "\",\"ph\":\"C\",\"pid\":0,\"ts\":" << counter_times[i]*1e-3
+              << ",\"args\":{\"value\":" << counters[i].second << "}}";
+    out << "\n]}\n";
+    return out.good();
+}
+
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <iostream>
+
+// wall time instrumentation, compiled in with -DENABLE_PROFILER=ON (the PROFILER macro), otherwise the macros expand to nothing:
+//   PROFILE_SCOPE("stage")      records the enclosing scope as an event of the Chrome trace and in the per-thread summary
+//   PROFILE_ACCUMULATE("stage") only adds the duration of the enclosing scope to the per-thread summary, for the fine-grained stages
+//   PROFILE_COUNTER("name", v)  records a value of a counter in the trace and in the summary
+namespace profiler {
+    std::int64_t now(); // ns since the start of the program
+
+    void record(const char *name, const std::int64_t begin, const std::int64_t end, const bool trace);
+    void counter(const char *name, const double value);
+
+    void summary(std::ostream &out);                 // per stage and per thread totals
+    bool write_trace(const std::string &filename);   // Chrome trace event format, open it in chrome://tracing or ui.perfetto.dev
+
+    template<bool trace> struct Scope {
+        const char *name;
+        const std::int64_t begin = now();
+        Scope(const char *name) : name(name) {}
+        ~Scope() { record(name, begin, now(), trace); }
+    };
+}
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#ifdef PROFILER
+#define PROFILE_SCOPE(name)      profiler::Scope<true>  PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_ACCUMULATE(name) profiler::Scope<false> PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_COUNTER(name, value) profiler::counter(name, value)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_ACCUMULATE(name)
+#define PROFILE_COUNTER(name, value)
+#endif
+
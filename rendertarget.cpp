@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <new>
+#include "rendertarget.h"
+#include "our_gl.h"
+
+namespace {
+    constexpr std::size_t alignment = 64; // cache line
+
+    template <typename T> T *allocate(const std::size_t n) {
+        return static_cast<T *>(::operator new[](n*sizeof(T), std::align_val_t(alignment)));
+    }
+}
+
+void RenderTarget::AlignedDelete::operator()(void *p) const {
+    ::operator delete[](p, std::align_val_t(alignment));
+}
+
+RenderTarget::RenderTarget(const int width, const int height, const bool has_color) : w(width), h(height),
+    pitch((width+tile_size-1)/tile_size*tile_size), rows((height+tile_size-1)/tile_size*tile_size) {
+    const std::size_t n = std::size_t(pitch)*rows;
+    if (has_color) color.reset(allocate<std::uint32_t>(n));
+    depth.reset(allocate<float>(n));
+    clear();
+}
+
+void RenderTarget::clear(const TGAColor &c) {
+    const std::uint32_t packed = pack(c);
+#pragma omp parallel for
+    for (int y=0; y<rows; y++) {
+        if (color) std::fill(color_row(y), color_row(y)+pitch, packed);
+        std::fill(depth_row(y), depth_row(y)+pitch, far);
+    }
+}
+
+TGAImage RenderTarget::image(const int bpp) const {
+    TGAImage img(w, h, bpp);
+    if (!color) return img;
+    std::uint8_t *out = img.buffer();
+#pragma omp parallel for
+    for (int y=0; y<h; y++) {
+        const std::uint32_t *row = color_row(y);
+        std::uint8_t *dst = out + std::size_t(y)*w*bpp;
+        for (int x=0; x<w; x++) // little-endian words are b,g,r,a in memory, the same order as the tga pixels
+            std::memcpy(dst + x*bpp, row+x, bpp);
+    }
+    return img;
+}
+
+std::size_t RenderTarget::covered() const {
+    std::size_t n = 0;
+#pragma omp parallel for reduction(+:n)
+    for (int y=0; y<h; y++)
+        n += std::count_if(depth_row(y), depth_row(y)+w, [](const float z) { return z!=far; });
+    return n;
+}
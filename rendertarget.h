@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include "tgaimage.h"
+
+// the buffers the rasterizer draws into: packed 32-bit BGRA color and 32-bit float depth, one word per pixel;
+// the buffers are padded to whole tiles and the rows start on a cache line, the writes are not bounds-checked,
+// and the color is converted to a TGAImage only once, when the frame is saved
+class RenderTarget {
+    struct AlignedDelete { void operator()(void *p) const; };
+    int w = 0, h = 0, pitch = 0, rows = 0; // pitch and rows: allocated row length and row count, multiples of the tile size
+    std::unique_ptr<std::uint32_t[], AlignedDelete> color{}; // absent for a depth-only target
+    std::unique_ptr<float[], AlignedDelete> depth{};
+public:
+    // depth of the cleared pixels, the depth is the view space distance along the viewing direction, the nearest fragment wins
+    static constexpr float far = std::numeric_limits<float>::max();
+
+    RenderTarget() = default;
+    RenderTarget(const int width, const int height, const bool has_color = true);
+    int width()  const { return w; }
+    int height() const { return h; }
+    int stride() const { return pitch; }
+    bool has_color() const { return color!=nullptr; }
+    void clear(const TGAColor &c = {}); // the color to c, the depth to far
+
+          std::uint32_t* color_row(const int y)       { return color.get() + std::size_t(y)*pitch; }
+    const std::uint32_t* color_row(const int y) const { return color.get() + std::size_t(y)*pitch; }
+          float* depth_row(const int y)       { return depth.get() + std::size_t(y)*pitch; }
+    const float* depth_row(const int y) const { return depth.get() + std::size_t(y)*pitch; }
+
+    static std::uint32_t pack(const TGAColor &c) {
+        std::uint32_t v;
+        std::memcpy(&v, c.bgra, 4);
+        return v;
+    }
+    static TGAColor unpack(const std::uint32_t v) {
+        TGAColor c;
+        std::memcpy(c.bgra, &v, 4);
+        c.bytespp = 4;
+        return c;
+    }
+
+    TGAImage image(const int bpp = TGAImage::RGB) const; // the color buffer as an image, GRAYSCALE keeps the blue channel
+    std::size_t covered() const;                         // number of pixels with a depth nearer than far
+};
@@ -0,0 +1,303 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "our_gl.h"
+#include "profiler.h"
+
+// the normal-mapped Phong shader of the demo, shared by the renderer and the benchmarks
+struct Shader final : IShader {
+    static constexpr bool discards = false;
+    const Model &model;
+    std::span<const int> facet;    // index buffer of the draw: the whole model or one of its levels of detail, the face indices refer to it
+    vec3 uniform_l;                    // light direction in view coordinates
+    std::vector<vec2> varying_uv;  // per-vertex uv coordinates, written by the vertex shader, read by the fragment shader
+    std::vector<vec3> varying_nrm; // per-vertex normal to be interpolated by FS
+    std::vector<vec4> varying_tan; // per-vertex tangent in view coordinates, handedness in w
+    const ShadowMap *shadow;       // optional, the light is never occluded without it
+    std::vector<vec3> varying_shadow; // per-vertex shadow map coordinates, the light projection is affine so they interpolate like the other varyings
+
+    Shader(const Model &m, const Uniforms &u, const vec3 light_dir, const ShadowMap *shadow = nullptr) : IShader(u), model(m), facet(m.indices()),
+        varying_uv(m.nverts()), varying_nrm(m.nverts()), varying_tan(m.nverts()), shadow(shadow), varying_shadow(shadow ? m.nverts() : 0) {
+        uniform_l = proj<3>((uniforms.ModelView*embed<4>(light_dir, 0.))).normalize(); // transform the light vector to view coordinates
+    }
+
+    virtual void vertex(const int ivert, vec4& gl_Position) {
+        varying_uv[ivert]  = model.uv(ivert);
+        varying_nrm[ivert] = proj<3>(uniforms.NormalMatrix*embed<4>(model.normal(ivert), 0.));
+        const vec4 t = model.tangent(ivert); // a direction along the surface, transformed like the positions
+        varying_tan[ivert] = embed<4>(proj<3>(uniforms.ModelView*embed<4>(proj<3>(t), 0.)), t[3]);
+        if (shadow) varying_shadow[ivert] = shadow->project(model.vert(ivert));
+        gl_Position = uniforms.MVP*embed<4>(model.vert(ivert));
+    }
+
+    void gather(const int iface, mat<2,3> &tri_uv, mat<3,3> &tri_nrm, mat<4,3> &tri_tan) const { // varyings of the triangle corners
+        for (int k : {0,1,2}) {
+            const int v = facet[iface*3+k];
+            tri_uv.set_col(k, varying_uv[v]);
+            tri_nrm.set_col(k, varying_nrm[v]);
+            tri_tan.set_col(k, varying_tan[v]);
+        }
+    }
+
+    float lit(const int iface, const vec3 bar) const { // fraction of the light reaching the fragment
+        if (!shadow) return 1;
+        vec3 q = {0,0,0};
+        for (int k : {0,1,2}) q = q + varying_shadow[facet[iface*3+k]]*bar[k];
+        return shadow->lit(q);
+    }
+
+    virtual bool fragment(const int iface, const vec3 bar, TGAColor &gl_FragColor) const {
+        mat<2,3> tri_uv;
+        mat<3,3> tri_nrm;
+        mat<4,3> tri_tan;
+        gather(iface, tri_uv, tri_nrm, tri_tan);
+        vec3 bn = (tri_nrm*bar).normalize(); // per-vertex normal interpolation
+        vec2 uv = tri_uv*bar; // tex coord interpolation
+
+        // the tangent frame is interpolated from the vertices (see Model::tangent) and orthonormalized, Gram-Schmidt;
+        // for the math refer to the tangent space normal mapping lecture
+        // https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
+        vec4 tw = tri_tan*bar;
+        vec3 t = proj<3>(tw);
+        t = (t - bn*(bn*t)).normalize();
+        vec3 b = cross(bn, t)*(tw[3]<0 ? -1.f : 1.f);
+        mat<3,3> B = mat<3,3>{ {t, b, bn} }.transpose();
+
+        vec3 n = (B * model.normal(uv)).normalize(); // transform the normal from the texture to the tangent space
+        float diff = std::max(0.f, n*uniform_l); // diffuse light intensity
+        vec3 r = (n*(n*uniform_l)*2 - uniform_l).normalize(); // reflected light direction, specular mapping is described here: https://github.com/ssloy/tinyrenderer/wiki/Lesson-6-Shaders-for-the-software-renderer
+        float spec = std::pow(std::max(-r.z, 0.f), 5+model.specular().sample(uv)[0]); // specular intensity, note that the camera lies on the z-axis (in view), therefore simple -r.z
+        float light = lit(iface, bar); // the occluded part of the light contributes neither diffuse nor specular
+
+        vec4 c = model.diffuse().sample(uv); // bilinear filtering, a single pixel has no derivatives to choose the mip level from
+        for (int i : {0,1,2})
+            gl_FragColor[i] = std::min<int>(10 + c[i]*(diff + spec)*light, 255); // (a bit of ambient light, diff + spec), clamp the result
+
+        return false; // the pixel is not discarded
+    }
+
+    // same lighting as fragment(), evaluated for packet_size pixels at once in float lanes;
+    // the textures are filtered trilinearly with the uv derivatives taken over the 2x2 quads
+    virtual unsigned fragment_packet(const int iface, const FragmentPacket &packet, TGAColor colors[packet_size]) const {
+        mat<2,3> tri_uv;
+        mat<3,3> tri_nrm;
+        mat<4,3> tri_tan;
+        gather(iface, tri_uv, tri_nrm, tri_tan);
+        float nrm[3][3], tan[4][3], tuv[2][3], l[3]; // per-triangle constants in single precision
+        for (int d : {0,1,2}) {
+            l[d]  = uniform_l[d];
+            for (int v : {0,1,2}) nrm[d][v] = tri_nrm[d][v];
+        }
+        for (int d=0; d<4; d++) for (int v : {0,1,2}) tan[d][v] = tri_tan[d][v];
+        for (int d : {0,1}) for (int v : {0,1,2}) tuv[d][v] = tri_uv[d][v];
+
+        alignas(32) float u[packet_size], v[packet_size], bn[3][packet_size], tg[3][packet_size], hand[packet_size];
+#pragma omp simd
+        for (int k=0; k<packet_size; k++) { // interpolate the varyings
+            const float b[3] = {packet.bar[0][k], packet.bar[1][k], packet.bar[2][k]};
+            u[k] = tuv[0][0]*b[0] + tuv[0][1]*b[1] + tuv[0][2]*b[2];
+            v[k] = tuv[1][0]*b[0] + tuv[1][1]*b[1] + tuv[1][2]*b[2];
+            float n[3], len2 = 0;
+            for (int d : {0,1,2}) { n[d] = nrm[d][0]*b[0] + nrm[d][1]*b[1] + nrm[d][2]*b[2]; len2 += n[d]*n[d]; }
+            for (int d : {0,1,2}) bn[d][k] = n[d]/std::sqrt(len2);
+            float t[3], nt = 0, lt = 0; // tangent orthogonalized against the normal
+            for (int d : {0,1,2}) { t[d] = tan[d][0]*b[0] + tan[d][1]*b[1] + tan[d][2]*b[2]; nt += t[d]*bn[d][k]; }
+            for (int d : {0,1,2}) { t[d] -= bn[d][k]*nt; lt += t[d]*t[d]; }
+            for (int d : {0,1,2}) tg[d][k] = t[d]/std::sqrt(lt);
+            hand[k] = tan[3][0]*b[0] + tan[3][1]*b[1] + tan[3][2]*b[2] < 0 ? -1.f : 1.f;
+        }
+
+        alignas(32) float dudx[packet_size], dudy[packet_size], dvdx[packet_size], dvdy[packet_size];
+        quad_derivatives(u, dudx, dudy);
+        quad_derivatives(v, dvdx, dvdy);
+
+        alignas(32) float tn[3][packet_size], spec_exp[packet_size], diffuse[3][packet_size], light[packet_size];
+        for (int k=0; k<packet_size; k++) { // texture fetches and shadow lookups are scalar gathers
+            if (!(packet.mask>>k & 1)) {
+                for (int d : {0,1,2}) tn[d][k] = diffuse[d][k] = 0;
+                spec_exp[k] = light[k] = 0;
+                continue;
+            }
+            light[k] = lit(iface, {packet.bar[0][k], packet.bar[1][k], packet.bar[2][k]});
+            const vec2 uv = {u[k], v[k]}, duvdx = {dudx[k], dvdx[k]}, duvdy = {dudy[k], dvdy[k]};
+            vec3 n = model.normal(uv, duvdx, duvdy);
+            vec4 c = model.diffuse().sample(uv, duvdx, duvdy);
+            for (int d : {0,1,2}) { tn[d][k] = n[d]; diffuse[d][k] = c[d]; }
+            spec_exp[k] = 5 + model.specular().sample(uv, duvdx, duvdy)[0];
+        }
+
+        alignas(32) float intensity[3][packet_size];
+#pragma omp simd
+        for (int k=0; k<packet_size; k++) { // tangent basis and lighting
+            const float b[3] = {bn[0][k], bn[1][k], bn[2][k]}, t[3] = {tg[0][k], tg[1][k], tg[2][k]};
+            const float bt[3] = {hand[k]*(b[1]*t[2]-b[2]*t[1]), hand[k]*(b[2]*t[0]-b[0]*t[2]), hand[k]*(b[0]*t[1]-b[1]*t[0])}; // bitangent
+            float n[3], len2 = 0;
+            for (int d : {0,1,2}) { n[d] = t[d]*tn[0][k] + bt[d]*tn[1][k] + b[d]*tn[2][k]; len2 += n[d]*n[d]; }
+            const float inv_len = 1/std::sqrt(len2);
+            for (int d : {0,1,2}) n[d] *= inv_len;
+            const float nl = n[0]*l[0] + n[1]*l[1] + n[2]*l[2];
+            const float diff = std::max(0.f, nl);
+            float r[3], lr = 0;
+            for (int d : {0,1,2}) { r[d] = n[d]*nl*2 - l[d]; lr += r[d]*r[d]; }
+            const float spec = std::pow(std::max(-r[2]/std::sqrt(lr), 0.f), spec_exp[k]);
+            for (int d : {0,1,2}) intensity[d][k] = std::min(10 + diffuse[d][k]*(diff + spec)*light[k], 255.f);
+        }
+        for (int k=0; k<packet_size; k++)
+            for (int d : {0,1,2})
+                colors[k][d] = intensity[d][k];
+        return packet.mask; // no pixel is discarded
+    }
+};
+
+// positions only, for the depth-only passes: a depth-only Rasterizer never calls the fragment shader
+struct DepthShader final : IShader {
+    const Model &model;
+    DepthShader(const Model &m, const Uniforms &u) : IShader(u), model(m) {}
+    virtual void vertex(const int ivert, vec4& gl_Position) { gl_Position = uniforms.MVP*embed<4>(model.vert(ivert)); }
+    virtual bool fragment(const int, const vec3, TGAColor &) const { return true; }
+};
+
+// renders the depth of the models as seen from the directional light into a size x size shadow map fitted to their bounding box
+inline ShadowMap shadow_map(const std::vector<Model> &models, const vec3 light_dir, const int size, RasterStats *stats = nullptr) {
+    PROFILE_SCOPE("shadow map");
+    vec3 bbox_min = { std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max()};
+    vec3 bbox_max = {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+    for (const Model &model : models)
+        for (int i=0; i<model.nverts(); i++)
+            for (int d : {0,1,2}) {
+                bbox_min[d] = std::min(bbox_min[d], model.vert(i)[d]);
+                bbox_max[d] = std::max(bbox_max[d], model.vert(i)[d]);
+            }
+    ShadowMap shadow(size, light_dir, bbox_min, bbox_max);
+    Rasterizer rasterizer(shadow.target);
+    rasterizer.cull = Cull::None; // the occluders may be open surfaces, the depth bias takes care of the acne
+    std::vector<DepthShader> shaders;
+    for (const Model &model : models) shaders.emplace_back(model, shadow.uniforms);
+    for (DepthShader &shader : shaders)
+        rasterizer.draw(shader, shader.model.nverts(), shader.model.indices());
+    rasterizer.flush();
+    if (stats) *stats += rasterizer.stats;
+    return shadow;
+}
+
+// collects the faces of the bvh leaves that may intersect the view frustum, the subtrees outside of it are skipped as a whole
+inline void frustum_cull(const Model &model, const Rasterizer &rasterizer, const Uniforms &uniforms, std::vector<int> &faces) {
+    PROFILE_SCOPE("frustum culling");
+    faces.clear();
+    const std::span<const Model::BVHNode> nodes = model.bvh();
+    if (nodes.empty()) return;
+    int stack[Model::max_bvh_depth], n = 0;
+    stack[n++] = 0;
+    while (n) {
+        const Model::BVHNode &node = nodes[stack[--n]];
+        if (!rasterizer.visible(node.bbox_min, node.bbox_max, uniforms)) continue;
+        if (node.count) {
+            const std::span<const int> leaf = model.bvh_faces().subspan(node.first, node.count);
+            faces.insert(faces.end(), leaf.begin(), leaf.end());
+            continue;
+        }
+        stack[n++] = node.first;       // right child
+        stack[n++] = &node-nodes.data()+1; // left child, visited first
+    }
+}
+
+// the coarsest level of detail of the model whose distance bound to the full mesh projects to at most max_error pixels;
+// the bounding sphere of the model is projected at its point nearest to the camera, 0 if the camera is inside of it
+inline int select_lod(const Model &model, const Uniforms &uniforms, const float max_error) {
+    if (max_error<=0 || model.lods()==1) return 0;
+    const Model::BVHNode &root = model.bvh()[0];
+    const vec3 c = proj<3>(uniforms.ModelView*embed<4>((root.bbox_min+root.bbox_max)/2));
+    const float r = (root.bbox_max-root.bbox_min).norm()/2, d = c.norm(); // the camera is at the origin of the view space
+    if (d<=r) return 0;
+    const vec3 p = c*(1-r/d);
+    const float delta = r*1e-3f;
+    const mat<4,4> VP = uniforms.Viewport*uniforms.Projection;
+    const vec4 a = VP*embed<4>(p), b = VP*embed<4>(p + vec3{delta,0,0});
+    const float pixels_per_unit = (proj<2>(b/b[3]) - proj<2>(a/a[3])).norm()/delta;
+    int level = 0;
+    while (level+1<model.lods() && model.lod_error(level+1)*pixels_per_unit<=max_error) level++;
+    return level;
+}
+
+struct RenderOptions {
+    bool frustum_culling = true;       // skip the bvh clusters outside of the view before the vertex shader
+    float lod_error = 1;               // error allowed to the levels of detail, in pixels; 0 always draws the full models
+    bool deferred = false;             // see Rasterizer::deferred
+    int samples = 1;                   // see Rasterizer::samples
+    const ShadowMap *shadow = nullptr; // no shadows without a map
+};
+
+// the camera of the renderer, the models around the center fill the middle 3/4 of the target
+inline Uniforms camera(const vec3 eye, const vec3 center, const vec3 up, const RenderTarget &target) {
+    const int width = target.width(), height = target.height();
+    return Uniforms(lookat(eye, center, up),                              // the ModelView matrix
+                    projection((eye-center).norm()),                      // the Projection matrix
+                    viewport(width/8, height/8, width*3/4, height*3/4)); // the Viewport matrix
+}
+
+// renders the models as seen from the camera into the target, cleared first
+inline RasterStats render(const std::vector<Model> &models, const vec3 eye, const vec3 center, const vec3 up, const vec3 light_dir,
+                          RenderTarget &target, const RenderOptions &options = {}) {
+    target.clear();
+    const Uniforms uniforms = camera(eye, center, up, target);
+    Rasterizer rasterizer(target);
+    rasterizer.deferred = options.deferred;
+    rasterizer.samples  = options.samples;
+    std::vector<Shader> shaders; // the binned triangles refer to the shaders (and the shaders to the models),
+    for (const Model &model : models) shaders.emplace_back(model, uniforms, light_dir, options.shadow); // therefore all of them must stay alive until the rasterizer is flushed
+
+    std::vector<int> faces;
+    for (Shader &shader : shaders) { // iterate through all input objects
+        const Model &model = shader.model;
+        if (const int level = select_lod(model, uniforms, options.lod_error)) { // a coarse level is drawn whole, the bvh is built over the full mesh
+            shader.facet = model.lod(level);
+            const int nfaces = shader.facet.size()/3;
+            rasterizer.stats.culled_lod += model.nfaces() - nfaces;
+            if (options.frustum_culling && !rasterizer.visible(model.bvh()[0].bbox_min, model.bvh()[0].bbox_max, uniforms)) {
+                rasterizer.stats.culled_frustum += nfaces;
+                continue;
+            }
+            faces.resize(nfaces);
+            std::iota(faces.begin(), faces.end(), 0);
+            rasterizer.draw(shader, model.nverts(), shader.facet, faces); // only the vertices used by the level are shaded
+            continue;
+        }
+        if (!options.frustum_culling) {
+            rasterizer.draw(shader, shader.model.nverts(), shader.model.indices());
+            continue;
+        }
+        frustum_cull(shader.model, rasterizer, uniforms, faces);
+        rasterizer.draw(shader, shader.model.nverts(), shader.model.indices(), faces);
+        rasterizer.stats.culled_frustum += shader.model.nfaces() - faces.size();
+    }
+    rasterizer.flush(); // actual rasterization routine call
+    return rasterizer.stats;
+}
+
+// same, straight from the obj files while they are parsed: every batch of faces handed out by a ModelStream is drawn and flushed
+// right away, the loader threads parse the next batches meanwhile, and the batches are freed as soon as they are rasterized;
+// the batches have neither a bvh nor levels of detail, and there are no shadows since the scene is never whole;
+// no MSAA either, options.samples is ignored: a multisampled frame must be flushed once (see Rasterizer::samples)
+inline RasterStats render_stream(const std::vector<std::string> &filenames, const vec3 eye, const vec3 center, const vec3 up, const vec3 light_dir,
+                                 RenderTarget &target, const RenderOptions &options = {}) {
+    target.clear();
+    const Uniforms uniforms = camera(eye, center, up, target);
+    Rasterizer rasterizer(target);
+    rasterizer.deferred = options.deferred;
+    std::deque<ModelStream> streams; // all the files are parsed at once, each one is bounded by its queue
+    for (const std::string &filename : filenames) streams.emplace_back(filename);
+    for (ModelStream &stream : streams)
+        while (std::optional<Model> batch = stream.next()) {
+            Shader shader(*batch, uniforms, light_dir);
+            rasterizer.draw(shader, batch->nverts(), batch->indices());
+            rasterizer.flush(); // the binned triangles refer to the shader and the batch
+        }
+    return rasterizer.stats;
+}
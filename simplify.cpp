@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include "simplify.h"
+#include "profiler.h"
+
+namespace {
+    constexpr double boundary_weight = 10; // the planes along the open boundaries weigh more than the faces, the silhouette holds
+    constexpr double max_fold = .5;        // cosine of the largest rotation of a face allowed to a collapse, 60 degrees
+    constexpr int cluster_faces = 1<<12;   // faces of the clusters simplified independently at the first level, the bound of a task
+
+    struct Quadric { // weighted sum of the squared distances to a set of planes, a symmetric 4x4 matrix, and the sum of the weights
+        double a[10] = {}; // upper triangle, row-major
+        double weight = 0;
+        void add_plane(const double n[3], const double d, const double w) {
+            const double p[4] = {n[0], n[1], n[2], d};
+            for (int i=0, k=0; i<4; i++)
+                for (int j=i; j<4; j++) a[k++] += w*p[i]*p[j];
+            weight += w;
+        }
+        Quadric& operator+=(const Quadric &q) {
+            for (int k=0; k<10; k++) a[k] += q.a[k];
+            weight += q.weight;
+            return *this;
+        }
+        double operator()(const vec3 &v) const { // mean squared distance of v to the planes
+            const double p[4] = {v.x, v.y, v.z, 1};
+            double e = 0;
+            for (int i=0, k=0; i<4; i++)
+                for (int j=i; j<4; j++, k++) e += (i==j ? 1 : 2)*a[k]*p[i]*p[j];
+            return weight>0 ? std::max(e, 0.)/weight : 0; // rounding may go below zero
+        }
+    };
+
+    struct Collapse { // the position from is merged into to
+        double cost;
+        int from, to;
+        unsigned from_version, to_version; // versions of the two quadrics the cost was computed with
+        bool operator>(const Collapse &c) const { // ties are broken by the indices, the result does not depend on the heap layout
+            return cost!=c.cost ? cost>c.cost : from!=c.from ? from>c.from : to>c.to;
+        }
+    };
+
+    struct PositionHash {
+        std::size_t operator()(const std::array<float, 3> &p) const {
+            std::uint32_t b[3];
+            std::memcpy(b, p.data(), sizeof(b));
+            return (std::size_t(b[0])*73856093) ^ (std::size_t(b[1])*19349663) ^ (std::size_t(b[2])*83492791);
+        }
+    };
+
+    std::uint32_t morton(const vec3 &p, const vec3 &lo, const float extent) { // 10 bits per axis, interleaved; the cells are cubes
+        std::uint32_t code = 0;
+        for (int d : {0,1,2}) {
+            std::uint32_t q = extent>0 ? std::min<std::uint32_t>(1023, (p[d]-lo[d])/extent*1024) : 0;
+            q = (q | q<<16) & 0x030000FF;
+            q = (q | q<<8)  & 0x0300F00F;
+            q = (q | q<<4)  & 0x030C30C3;
+            q = (q | q<<2)  & 0x09249249;
+            code |= q<<d;
+        }
+        return code;
+    }
+
+    void plane(const vec3 &a, const vec3 &b, const vec3 &c, double n[3], double &area2) { // unit normal and twice the area of abc
+        const double e1[3] = {b.x-a.x, b.y-a.y, b.z-a.z}, e2[3] = {c.x-a.x, c.y-a.y, c.z-a.z};
+        n[0] = e1[1]*e2[2]-e1[2]*e2[1];
+        n[1] = e1[2]*e2[0]-e1[0]*e2[2];
+        n[2] = e1[0]*e2[1]-e1[1]*e2[0];
+        area2 = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (area2>0) for (int d : {0,1,2}) n[d] /= area2;
+    }
+}
+
+std::vector<SimplifiedLevel> simplify(std::span<const vec3> verts, std::span<const int> indices, const int max_levels, const int min_faces) {
+    PROFILE_SCOPE("simplify");
+    std::vector<SimplifiedLevel> levels;
+    const int nverts = verts.size(), nfaces = indices.size()/3;
+
+    // the vertices split along the uv seams and the hard edges share their positions, the topology is that of the positions
+    std::vector<int> pos_of(nverts);
+    std::vector<vec3> pos;
+    {
+        std::unordered_map<std::array<float, 3>, int, PositionHash> welded;
+        welded.reserve(nverts);
+        for (int v=0; v<nverts; v++) {
+            auto [it, inserted] = welded.try_emplace({verts[v].x, verts[v].y, verts[v].z}, (int)pos.size());
+            if (inserted) pos.push_back(verts[v]);
+            pos_of[v] = it->second;
+        }
+    }
+    const int npos = pos.size();
+
+    std::vector<std::array<int, 3>> faces(nfaces);       // vertex indices, rewritten by the collapses
+    std::vector<std::uint8_t> alive(nfaces, 0);
+    std::vector<std::vector<int>> around(npos);          // faces incident to every position, the dead ones are pruned lazily
+    int nalive = 0;
+    for (int f=0; f<nfaces; f++) {
+        faces[f] = {indices[f*3], indices[f*3+1], indices[f*3+2]};
+        const int a = pos_of[faces[f][0]], b = pos_of[faces[f][1]], c = pos_of[faces[f][2]];
+        if (a==b || b==c || c==a) continue; // degenerate, dropped from all the levels
+        alive[f] = 1;
+        nalive++;
+        for (int p : {a, b, c}) around[p].push_back(f);
+    }
+
+    std::vector<Quadric> quadric(npos);
+    std::vector<std::uint64_t> edges; // every undirected edge once per face, sorted: the open boundary edges appear once
+    edges.reserve(std::size_t(nalive)*3);
+    auto edge_key = [](const int a, const int b) { return std::uint64_t(std::min(a, b))<<32 | std::uint32_t(std::max(a, b)); };
+    for (int f=0; f<nfaces; f++) {
+        if (!alive[f]) continue;
+        const int p[3] = {pos_of[faces[f][0]], pos_of[faces[f][1]], pos_of[faces[f][2]]};
+        double n[3], area2;
+        plane(pos[p[0]], pos[p[1]], pos[p[2]], n, area2);
+        if (area2>0)
+            for (int k : {0,1,2}) quadric[p[k]].add_plane(n, -(n[0]*pos[p[0]].x + n[1]*pos[p[0]].y + n[2]*pos[p[0]].z), area2/2); // weighted by the area
+        for (int k : {0,1,2}) edges.push_back(edge_key(p[k], p[(k+1)%3]));
+    }
+    std::sort(edges.begin(), edges.end());
+    for (int f=0; f<nfaces; f++) { // the boundary edges get a plane through them, perpendicular to their face
+        if (!alive[f]) continue;
+        const int p[3] = {pos_of[faces[f][0]], pos_of[faces[f][1]], pos_of[faces[f][2]]};
+        double n[3], area2;
+        plane(pos[p[0]], pos[p[1]], pos[p[2]], n, area2);
+        if (area2==0) continue;
+        for (int k : {0,1,2}) {
+            const int a = p[k], b = p[(k+1)%3];
+            const auto [first, last] = std::equal_range(edges.begin(), edges.end(), edge_key(a, b));
+            if (last-first!=1) continue;
+            const double e[3] = {pos[b].x-pos[a].x, pos[b].y-pos[a].y, pos[b].z-pos[a].z};
+            double m[3] = {e[1]*n[2]-e[2]*n[1], e[2]*n[0]-e[0]*n[2], e[0]*n[1]-e[1]*n[0]};
+            const double len = std::sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+            if (len==0) continue;
+            for (int d : {0,1,2}) m[d] /= len;
+            const double d = -(m[0]*pos[a].x + m[1]*pos[a].y + m[2]*pos[a].z);
+            quadric[a].add_plane(m, d, boundary_weight*(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]));
+            quadric[b].add_plane(m, d, boundary_weight*(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]));
+        }
+    }
+    std::vector<std::uint64_t>().swap(edges);
+
+    // the faces in Morton order of their centroids: the clusters are aligned ranges of that order, cluster_faces long at the first level
+    // and four times as long at every next one, a cluster of a level is the union of four of the previous level: the faces of a cluster
+    // double from a level to the next, its border shrinks relative to them, and the coarse levels are as good as a global simplification
+    std::vector<int> order;
+    {
+        vec3 lo = pos.empty() ? vec3{0,0,0} : pos[0], hi = lo;
+        for (const vec3 &p : pos)
+            for (int d : {0,1,2}) { lo[d] = std::min(lo[d], p[d]); hi[d] = std::max(hi[d], p[d]); }
+        const float extent = std::max({hi.x-lo.x, hi.y-lo.y, hi.z-lo.z});
+        std::vector<std::pair<std::uint32_t, int>> keyed;
+        keyed.reserve(nalive);
+        for (int f=0; f<nfaces; f++)
+            if (alive[f]) keyed.push_back({morton((pos[pos_of[faces[f][0]]] + pos[pos_of[faces[f][1]]] + pos[pos_of[faces[f][2]]])/3, lo, extent), f});
+        std::sort(keyed.begin(), keyed.end());
+        order.reserve(keyed.size());
+        for (const auto &k : keyed) order.push_back(k.second);
+    }
+
+    std::vector<unsigned> version(npos, 0);
+    std::vector<std::uint8_t> removed(npos, 0);
+    std::vector<int> owner(npos); // the cluster of the alive faces around a position, -2 if they belong to several: the position is locked
+
+    // collapses the unlocked positions of a cluster until its face count is halved or no valid collapse is left; the clusters of a level
+    // share no unlocked position, and no face: they are simplified in parallel, and the result does not depend on the scheduling
+    auto simplify_cluster = [&](const int cluster, const std::size_t begin, const std::size_t end, int &cluster_alive) {
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+        std::vector<int> np, nq, common, own;
+        std::vector<std::pair<int, int>> remap; // vertices at the removed position and their counterparts at the kept one
+        auto unlocked = [&](const int p) { return owner[p]==cluster; };
+        auto neighbours = [&](const int p, std::vector<int> &out) {
+            std::erase_if(around[p], [&](const int f) { return !alive[f]; });
+            out.clear();
+            for (int f : around[p])
+                for (int v : faces[f])
+                    if (pos_of[v]!=p) out.push_back(pos_of[v]);
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+        };
+        auto cost = [&](const int from, const int to) {
+            Quadric q = quadric[from];
+            q += quadric[to];
+            return q(pos[to]);
+        };
+        auto push = [&](const int p) { // all the collapses of the edges around p, in both directions
+            neighbours(p, np);
+            for (int q : np) {
+                if (!unlocked(q)) continue;
+                heap.push({cost(p, q), p, q, version[p], version[q]});
+                heap.push({cost(q, p), q, p, version[q], version[p]});
+            }
+        };
+        auto wedge_at = [&](const int f, const int p) { // the vertex of the face f at the position p, -1 if none
+            for (int v : faces[f]) if (pos_of[v]==p) return v;
+            return -1;
+        };
+
+        cluster_alive = 0;
+        for (std::size_t i=begin; i<end; i++) {
+            if (!alive[order[i]]) continue;
+            cluster_alive++;
+            for (int v : faces[order[i]]) if (unlocked(pos_of[v])) own.push_back(pos_of[v]);
+        }
+        std::sort(own.begin(), own.end());
+        own.erase(std::unique(own.begin(), own.end()), own.end());
+        for (int p : own) {
+            neighbours(p, np);
+            for (int q : np) if (unlocked(q)) heap.push({cost(p, q), p, q, version[p], version[q]});
+        }
+
+        const int target = cluster_alive/2;
+        double error = 0;
+        while (cluster_alive>target && !heap.empty()) {
+            const Collapse c = heap.top();
+            heap.pop();
+            const int P = c.from, Q = c.to;
+            if (removed[P] || removed[Q] || c.from_version!=version[P] || c.to_version!=version[Q]) continue; // stale
+
+            // every vertex at P must have a single counterpart at Q: the faces of P that touch Q tell which one
+            neighbours(P, np);
+            remap.clear();
+            bool valid = true;
+            int shared = 0;
+            for (int f : around[P]) {
+                const int wq = wedge_at(f, Q);
+                if (wq<0) continue;
+                shared++;
+                const int wp = wedge_at(f, P);
+                auto it = std::find_if(remap.begin(), remap.end(), [wp](const std::pair<int, int> &r) { return r.first==wp; });
+                if (it==remap.end()) remap.push_back({wp, wq});
+                else valid &= it->second==wq; // a seam or a hard edge crosses the fan of wp at Q
+            }
+            for (int f : around[P]) {
+                const int wp = wedge_at(f, P);
+                valid &= std::any_of(remap.begin(), remap.end(), [wp](const std::pair<int, int> &r) { return r.first==wp; });
+            }
+            if (!valid || !shared) continue;
+
+            // link condition: P and Q may only share the neighbours opposite to the edge PQ, or the surface pinches
+            neighbours(Q, nq);
+            common.clear();
+            std::set_intersection(np.begin(), np.end(), nq.begin(), nq.end(), std::back_inserter(common));
+            if ((int)common.size()>shared) continue;
+
+            for (int f : around[P]) { // no face may flip, or fold too much, when P moves to Q
+                if (wedge_at(f, Q)>=0) continue;
+                vec3 p[3], moved[3];
+                for (int k : {0,1,2}) {
+                    p[k] = pos[pos_of[faces[f][k]]];
+                    moved[k] = pos_of[faces[f][k]]==P ? pos[Q] : p[k];
+                }
+                double n0[3], n1[3], a0, a1;
+                plane(p[0], p[1], p[2], n0, a0);
+                plane(moved[0], moved[1], moved[2], n1, a1);
+                valid &= a1>0 && (a0==0 || n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] > max_fold);
+            }
+            if (!valid) continue;
+
+            for (int f : around[P]) {
+                if (wedge_at(f, Q)>=0) { // the faces along the edge vanish
+                    alive[f] = 0;
+                    cluster_alive--;
+                    continue;
+                }
+                for (int &v : faces[f])
+                    if (pos_of[v]==P) v = std::find_if(remap.begin(), remap.end(), [v](const std::pair<int, int> &r) { return r.first==v; })->second;
+                around[Q].push_back(f);
+            }
+            around[P].clear();
+            removed[P] = 1;
+            quadric[Q] += quadric[P];
+            version[Q]++;
+            error = std::max(error, c.cost);
+            push(Q);
+        }
+        return error;
+    };
+
+    // every level halves the clusters, the collapses along the borders of the clusters wait for a coarser level where the two sides
+    // are merged; a level is kept if it is significantly coarser than the previous one
+    int previous = nalive;
+    double error = 0;
+    for (std::size_t span = cluster_faces; (int)levels.size()<max_levels && previous/2>=min_faces; span *= 4) {
+        const int nclusters = (order.size()+span-1)/span;
+        std::fill(owner.begin(), owner.end(), -1);
+        for (int c=0; c<nclusters; c++)
+            for (std::size_t i=c*span; i<std::min((c+1)*span, order.size()); i++)
+                if (alive[order[i]])
+                    for (int v : faces[order[i]]) {
+                        int &o = owner[pos_of[v]];
+                        o = o==-1 || o==c ? c : -2;
+                    }
+        std::vector<double> errors(nclusters, 0);
+        std::vector<int> counts(nclusters, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int c=0; c<nclusters; c++)
+            errors[c] = simplify_cluster(c, c*span, std::min((c+1)*span, order.size()), counts[c]);
+        nalive = 0;
+        for (int c=0; c<nclusters; c++) {
+            nalive += counts[c];
+            error = std::max(error, errors[c]);
+        }
+        if (nalive<previous*3/4) {
+            SimplifiedLevel level{{}, float(std::sqrt(error))};
+            level.indices.reserve(nalive*3);
+            for (int f=0; f<nfaces; f++)
+                if (alive[f]) level.indices.insert(level.indices.end(), faces[f].begin(), faces[f].end());
+            levels.push_back(std::move(level));
+            previous = nalive;
+        } else if (nclusters==1) // nothing left to collapse
+            break;
+    }
+    return levels;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <span>
+#include <vector>
+#include "geometry.h"
+
+struct SimplifiedLevel {
+    std::vector<int> indices; // index buffer into the original vertex array, 3 indices per triangle
+    float error;              // distance between this level and the original surface, in model units, see simplify()
+};
+
+// quadric error metric simplification (Garland & Heckbert) by half-edge collapses: a vertex is merged into one of its
+// neighbours, so no vertex is ever moved or created and all the levels share the vertex array of the original mesh.
+// The vertices are the (position, tex coord, normal) triples of the model: the ones sharing a position are welded for the
+// topology, and a collapse is only allowed if every tex coord/normal of the removed vertex maps to a single one of the kept
+// vertex, which keeps the uv seams and the hard edges in place. Every level has half the faces of the previous one;
+// the chain stops after max_levels levels, below min_faces faces, or when no valid collapse is left.
+// The faces are split into spatial clusters, simplified in parallel with their borders locked; the clusters grow from a level
+// to the next, so the work and the memory of a task stay bounded and the borders are simplified once merged.
+// The error of a level is the largest collapse cost so far: the root mean square distance of a merged vertex
+// to the planes of the original faces it absorbed, weighted by their areas.
+std::vector<SimplifiedLevel> simplify(std::span<const vec3> verts, std::span<const int> indices, const int max_levels, const int min_faces);
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cmath>
+#include "texture.h"
+#include "profiler.h"
+
+namespace {
+    constexpr int tile = 4; // tiles are tile x tile texels
+
+    int level_dim(const int dim, const int level) {
+        return std::max(1, dim>>level);
+    }
+
+    std::size_t tiled_size(const int w, const int h) {
+        return std::size_t((w+tile-1)/tile)*((h+tile-1)/tile)*tile*tile;
+    }
+
+    std::size_t tiled_index(const unsigned w, const unsigned x, const unsigned y) {
+        return (std::size_t(y/tile)*((w+tile-1)/tile) + x/tile)*tile*tile + (y%tile)*tile + x%tile;
+    }
+}
+
+std::size_t Texture::size(const int w, const int h) {
+    std::size_t ret = 0;
+    for (int l=0; w>0 && h>0; l++) {
+        ret += tiled_size(level_dim(w, l), level_dim(h, l));
+        if (level_dim(w, l)==1 && level_dim(h, l)==1) break;
+    }
+    return ret;
+}
+
+void Texture::init_levels() {
+    offsets.clear();
+    std::size_t offset = 0;
+    for (int l=0; w>0 && h>0; l++) {
+        offsets.push_back(offset);
+        offset += tiled_size(level_dim(w, l), level_dim(h, l));
+        if (level_dim(w, l)==1 && level_dim(h, l)==1) break;
+    }
+    nlevels = offsets.size();
+}
+
+Texture::Texture(const int w, const int h, std::span<const std::uint32_t> texels, std::shared_ptr<const void> storage) :
+    w(w), h(h), storage(storage), texels(texels) {
+    init_levels();
+}
+
+Texture::Texture(const TGAImage &img) : w(img.width()), h(img.height()) {
+    PROFILE_SCOPE("build mipmaps");
+    if (!img.buffer() || w<=0 || h<=0) {
+        w = h = 0;
+        return;
+    }
+    init_levels();
+    auto data = std::make_shared<std::vector<std::uint32_t>>(size(w, h));
+    const int bpp = img.bytespp();
+    std::vector<std::uint32_t> level(std::size_t(w)*h), next; // the current level in the linear order
+#pragma omp parallel for
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++) {
+            const std::uint8_t *p = img.buffer() + (x+y*w)*bpp;
+            const std::uint32_t b = p[0], g = bpp>1 ? p[1] : b, r = bpp>1 ? p[2] : b, a = bpp>3 ? p[3] : 255; // grayscale is replicated
+            level[x+y*w] = b | g<<8 | r<<16 | a<<24;
+        }
+    for (int l=0; l<nlevels; l++) {
+        const int lw = level_dim(w, l), lh = level_dim(h, l);
+        std::uint32_t *dst = data->data() + offsets[l];
+#pragma omp parallel for
+        for (int y=0; y<lh; y++)
+            for (int x=0; x<lw; x++)
+                dst[tiled_index(lw, x, y)] = level[x+y*lw];
+        if (l+1==nlevels) break;
+        const int nw = level_dim(w, l+1), nh = level_dim(h, l+1);
+        next.resize(std::size_t(nw)*nh);
+#pragma omp parallel for
+        for (int y=0; y<nh; y++) // 2x2 box filter, the odd last row/column is clamped
+            for (int x=0; x<nw; x++) {
+                const int x0 = std::min(2*x, lw-1), x1 = std::min(2*x+1, lw-1), y0 = std::min(2*y, lh-1), y1 = std::min(2*y+1, lh-1);
+                const std::uint32_t c[4] = {level[x0+y0*lw], level[x1+y0*lw], level[x0+y1*lw], level[x1+y1*lw]};
+                std::uint32_t avg = 0;
+                for (int ch=0; ch<4; ch++) {
+                    const std::uint32_t sum = (c[0]>>(8*ch) & 0xff) + (c[1]>>(8*ch) & 0xff) + (c[2]>>(8*ch) & 0xff) + (c[3]>>(8*ch) & 0xff);
+                    avg |= ((sum+2)/4) << (8*ch);
+                }
+                next[x+y*nw] = avg;
+            }
+        std::swap(level, next);
+    }
+    texels  = *data;
+    storage = data;
+}
+
+std::uint32_t Texture::texel(const int level, const int x, const int y) const {
+    return texels[offsets[level] + tiled_index(level_dim(w, level), x, y)];
+}
+
+vec4 Texture::bilinear(const int level, const float u, const float v) const {
+    const int lw = level_dim(w, level), lh = level_dim(h, level);
+    const float x = u*lw - .5f, y = v*lh - .5f; // texel centers lie at half-integer coordinates
+    const int x0 = std::floor(x), y0 = std::floor(y);  // u,v are in [0,1), thus x0 and y0 are in [-1, dim-1]
+    const float fx = x - x0, fy = y - y0;
+    const int xa = x0<0 ? lw-1 : x0, xb = x0+1==lw ? 0 : x0+1; // wrap around
+    const int ya = y0<0 ? lh-1 : y0, yb = y0+1==lh ? 0 : y0+1;
+    const std::uint32_t c[4] = {texel(level, xa, ya), texel(level, xb, ya), texel(level, xa, yb), texel(level, xb, yb)};
+    const float wt[4] = {(1-fx)*(1-fy), fx*(1-fy), (1-fx)*fy, fx*fy};
+    vec4 ret;
+    for (int ch=0; ch<4; ch++)
+        ret[ch] = wt[0]*(c[0]>>(8*ch) & 0xff) + wt[1]*(c[1]>>(8*ch) & 0xff) + wt[2]*(c[2]>>(8*ch) & 0xff) + wt[3]*(c[3]>>(8*ch) & 0xff);
+    return ret;
+}
+
+vec4 Texture::sample(const vec2 &uv, const float lod) const {
+    if (!nlevels || !std::isfinite(uv.x) || !std::isfinite(uv.y)) return {};
+    const float l = std::clamp(std::isnan(lod) ? 0.f : lod, 0.f, float(nlevels-1));
+    const int l0 = l;
+    const float t = l - l0;
+    const float u = uv.x - std::floor(uv.x), v = uv.y - std::floor(uv.y); // wrap around
+    const vec4 c0 = bilinear(l0, std::min(u, .99999994f), std::min(v, .99999994f)); // u - floor(u) may round up to 1
+    if (t==0) return c0;
+    return c0*(1-t) + bilinear(l0+1, std::min(u, .99999994f), std::min(v, .99999994f))*t;
+}
+
+vec4 Texture::sample(const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy) const {
+    const vec2 dx = {duvdx.x*w, duvdx.y*h}, dy = {duvdy.x*w, duvdy.y*h}; // derivatives in texels of the base level
+    const float rho2 = std::max(dx.norm2(), dy.norm2());
+    return sample(uv, rho2>1 ? .5f*std::log2(rho2) : 0.f);
+}
+
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// read-only RGBA8 texture with a full mip chain; every level is stored in 4x4 texel tiles (one 64-byte cache line each),
+// the tiles are row-major, so that a bilinear footprint mostly falls into a single cache line.
+// Texels are returned as floats in [0,255], in the TGAColor channel order (b,g,r,a); the tex coords wrap around.
+class Texture {
+    int w = 0, h = 0, nlevels = 0;
+    std::shared_ptr<const void> storage{};   // owns the texels: either built here or a mapped file
+    std::span<const std::uint32_t> texels{}; // all the levels one after another
+    std::vector<std::size_t> offsets{};      // offset of every level in the texels array
+    void init_levels();
+    std::uint32_t texel(const int level, const int x, const int y) const;
+    vec4 bilinear(const int level, const float u, const float v) const; // u,v in [0,1)
+public:
+    Texture() = default;
+    Texture(const TGAImage &img); // builds the mip chain
+    Texture(const int w, const int h, std::span<const std::uint32_t> texels, std::shared_ptr<const void> storage); // view of prebuilt texels
+    static std::size_t size(const int w, const int h); // number of texels in the mip chain of a w x h image
+    int width()  const { return w; }
+    int height() const { return h; }
+    int levels() const { return nlevels; }
+    std::span<const std::uint32_t> data() const { return texels; }
+
+    vec4 sample(const vec2 &uv, const float lod=0) const; // trilinear filtering, bilinear for an integer level of detail
+    vec4 sample(const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy) const; // the level of detail is chosen from the screen-space derivatives
+};
+
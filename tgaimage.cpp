@@ -1,205 +1,114 @@
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 #include "tgaimage.h"
+#include "encoder.h"
+#include "profiler.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {}
 
 bool TGAImage::read_tga_file(const std::string filename) {
+    PROFILE_SCOPE("read tga");
     std::ifstream in;
-    in.open (filename, std::ios::binary);
+    in.open (filename, std::ios::binary | std::ios::ate);
     if (!in.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         in.close();
         return false;
     }
+    std::vector<std::uint8_t> file(std::max<std::streamoff>(in.tellg(), 0)); // the whole file is read at once and decoded from memory
+    in.seekg(0);
+    in.read(reinterpret_cast<char *>(file.data()), file.size());
+    const bool ok = in.good();
+    in.close();
     TGAHeader header;
-    in.read(reinterpret_cast<char *>(&header), sizeof(header));
-    if (!in.good()) {
-        in.close();
+    if (!ok || file.size()<sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    std::memcpy(&header, file.data(), sizeof(header));
     w   = header.width;
     h   = header.height;
     bpp = header.bitsperpixel>>3;
     if (w<=0 || h<=0 || (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA)) {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
+    const std::uint8_t *p = file.data() + sizeof(header) + header.idlength, *end = file.data() + file.size();
+    const bool vflip = !(header.imagedescriptor & 0x20); // bottom-left origin: the rows are stored in the reverse order
     size_t nbytes = bpp*w*h;
-    data = std::vector<std::uint8_t>(nbytes, 0);
+    data = std::vector<std::uint8_t>(nbytes);
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
-        if (!in.good()) {
-            in.close();
+        if (p>end || size_t(end-p)<nbytes) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        for (int y=0; y<h; y++) // the rows land directly at their place, no flip is needed afterwards
+            std::memcpy(data.data()+size_t(vflip ? h-1-y : y)*w*bpp, p+size_t(y)*w*bpp, size_t(w)*bpp);
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
+        if (p>end || !load_rle_data(p, end, vflip)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     } else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
     if (header.imagedescriptor & 0x10)
         flip_horizontally();
     std::cerr << w << "x" << h << "/" << bpp*8 << "\n";
-    in.close();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    size_t pixelcount = w*h;
+// the packets are expanded with bulk copies, a packet may cross the scanlines
+bool TGAImage::load_rle_data(const std::uint8_t *p, const std::uint8_t *end, const bool vflip) {
+    const size_t rowbytes = size_t(w)*bpp;
+    size_t pixelcount = size_t(w)*h;
     size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+    // writes n pixels: a copy of src, or n times the first pixel of src if run
+    auto emit = [&](const std::uint8_t *src, size_t n, const bool run) {
+        while (n) {
+            const size_t y = currentpixel/w, x = currentpixel%w, k = std::min<size_t>(n, w-x);
+            std::uint8_t *dst = data.data() + (vflip ? h-1-y : y)*rowbytes + x*bpp;
+            if (!run) {
+                std::memcpy(dst, src, k*bpp);
+                src += k*bpp;
+            } else if (1==bpp) {
+                std::memset(dst, *src, k);
+            } else {
+                std::memcpy(dst, src, bpp);
+                for (size_t done=1; done<k; done*=2) // doubling copies
+                    std::memcpy(dst+done*bpp, dst, std::min(done, k-done)*bpp);
+            }
+            currentpixel += k;
+            n -= k;
+        }
+    };
+    while (currentpixel<pixelcount) {
+        if (p>=end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        }
-    } while (currentpixel < pixelcount);
-    return true;
-}
-
-bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
-    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
-    std::ofstream out;
-    out.open (filename, std::ios::binary);
-    if (!out.is_open()) {
-        std::cerr << "can't open file " << filename << "\n";
-        out.close();
-        return false;
-    }
-    TGAHeader header;
-    header.bitsperpixel = bpp<<3;
-    header.width  = w;
-    header.height = h;
-    header.datatypecode = (bpp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    if (!rle) {
-        out.write(reinterpret_cast<const char *>(data.data()), w*h*bpp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            out.close();
+        std::uint8_t chunkheader = *p++;
+        const bool run = chunkheader>=128;
+        const size_t n = run ? chunkheader-127 : chunkheader+1;
+        const size_t nbytes = run ? bpp : n*bpp;
+        if (size_t(end-p)<nbytes) {
+            std::cerr << "an error occured while reading the data\n";
             return false;
         }
-    } else if (!unload_rle_data(out)) {
-            out.close();
-            std::cerr << "can't unload rle data\n";
+        if (currentpixel+n>pixelcount) {
+            std::cerr << "Too many pixels read\n";
             return false;
         }
-    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
-    }
-    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
-    }
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+        emit(p, n, run);
+        p += nbytes;
     }
-    out.close();
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) const {
-    const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w*h;
-    size_t curpix = 0;
-    while (curpix<npixels) {
-        size_t chunkstart = curpix*bpp;
-        size_t curbyte = curpix*bpp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bpp; t++)
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bpp]);
-            curbyte += bpp;
-            if (1==run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bpp:bpp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-    }
-    return true;
+bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
+    return write_file(filename, encode_tga(*this, vflip, rle)); // the rows are encoded in parallel, then written at once
 }
 
 TGAColor TGAImage::get(const int x, const int y) const {
@@ -214,19 +123,17 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
 }
 
 void TGAImage::flip_horizontally() {
-    int half = w>>1;
-    for (int i=0; i<half; i++)
-        for (int j=0; j<h; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(w-1-i+j*w)*bpp+b]);
+    for (int j=0; j<h; j++) {
+        std::uint8_t *row = data.data() + size_t(j)*w*bpp;
+        for (int i=0; i<w/2; i++)
+            std::swap_ranges(row+i*bpp, row+(i+1)*bpp, row+(w-1-i)*bpp);
+    }
 }
 
-void TGAImage::flip_vertically() {
-    int half = h>>1;
-    for (int i=0; i<w; i++)
-        for (int j=0; j<half; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(i+(h-1-j)*w)*bpp+b]);
+void TGAImage::flip_vertically() { // whole rows are swapped
+    const size_t rowbytes = size_t(w)*bpp;
+    for (int j=0; j<h/2; j++)
+        std::swap_ranges(data.begin()+j*rowbytes, data.begin()+(j+1)*rowbytes, data.begin()+(h-1-j)*rowbytes);
 }
 
 int TGAImage::width() const {
@@ -237,4 +144,15 @@ int TGAImage::height() const {
     return h;
 }
 
+int TGAImage::bytespp() const {
+    return bpp;
+}
+
+std::uint8_t* TGAImage::buffer() {
+    return data.data();
+}
+
+const std::uint8_t* TGAImage::buffer() const {
+    return data.data();
+}
 